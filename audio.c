@@ -13,6 +13,7 @@
 
 static const char rcsid[] = "$Id: audio.c,v 1.3 2002/06/10 21:25:48 chris Exp $";
 
+#include <pthread.h>
 #include <string.h>
 
 #include "driftnet.h"
@@ -24,25 +25,80 @@ static const char rcsid[] = "$Id: audio.c,v 1.3 2002/06/10 21:25:48 chris Exp $"
  * between them in chunks of this size. */
 #define MIN_MPEG_EXTENT     100
 
+static pattern p_sync;
+static pthread_once_t patterns_once = PTHREAD_ONCE_INIT;
+
+/* compile_patterns:
+ * Compile the frame sync byte we look for. */
+static void compile_patterns(void) {
+    p_sync = pattern_new((unsigned char*)"\xff", 1);
+}
+
+/* check_mpeg_stream DATA LEN STATE MPEGDATA MPEGLEN
+ * DATA, of length LEN, starts with an MPEG sync word; see whether it's the
+ * start of a stream. Returns as check_gif_image does; STATE records the
+ * offset of the next frame header and the number of frames seen so far. */
+unsigned char *check_mpeg_stream(const unsigned char *data, const size_t len, struct mediastate *S, unsigned char **mpegdata, size_t *mpeglen) {
+    unsigned char *stream_start = (unsigned char*)data, *q;
+    struct mpeg_audio_hdr H;
+    int nframes;
+    *mpegdata = NULL;
+
+    if (S->pos == 0) {
+        /* OK, found something which might be a header.... */
+        if (!mpeg_hdr_parse(stream_start, &H))
+            return stream_start + 1;
+        nframes = 0;
+        q = stream_start;
+    } else {
+        /* Carry on from the frame we got to last time. */
+        nframes = S->count;
+        q = stream_start + S->pos;
+        if (!(q < data + len - 4 && mpeg_hdr_parse(q, &H)))
+            return stream_start;
+    }
+
+    /* See how many frames we get. */
+    do {
+        int delta;
+        ++nframes;
+        delta = mpeg_hdr_nextframe_offset(&H);
+        if (delta == 0)
+            return q + 1;
+        q += delta;
+    } while (nframes < MIN_MPEG_EXTENT && q < data + len - 4 && mpeg_hdr_parse(q, &H));
+
+    if (nframes >= MIN_MPEG_EXTENT) {
+        /* got some data. */
+/*        printf("stream_start = %p, q = %p, len = %d\n", stream_start, q, q - stream_start);*/
+        *mpegdata = stream_start;
+        *mpeglen = q - stream_start;
+        return q;
+    } else {
+        S->pos = q - stream_start;
+        S->count = nframes;
+        return stream_start;
+    }
+}
+
 /* find_mpeg_stream:
  * Try to find some MPEG data in a stream. The game here is that we look for
  * an MPEG audio header and see whether it's followed by a bunch more MPEG
  * audio headers. If there's as much as MIN_MPEG_EXTEND data, then we give
  * it back to the application and move our pointer on. */
 unsigned char *find_mpeg_stream(const unsigned char *data, const size_t len, unsigned char **mpegdata, size_t *mpeglen) {
-    unsigned char *stream_start, *p;
-    struct mpeg_audio_hdr H;
+    unsigned char *stream_start, *p, *q;
+    struct mediastate S;
     *mpegdata = NULL;
 
+    pthread_once(&patterns_once, compile_patterns);
+
     if (len < 4) return (unsigned char*)data;
 /*printf("find_mpeg_stream\n"); */
     p = (unsigned char*)data;
     while (p < data + len - 4) {
-        int nframes;
-        unsigned char *q;
-
         /* Look for something which might be a frame header. */
-        stream_start = memchr(p, 0xff, len - 4 - (p - data));
+        stream_start = pattern_find(p_sync, p, len - 4 - (p - data));
         if (!stream_start)
             return (unsigned char*)(data + len - 4);
 
@@ -52,32 +108,11 @@ unsigned char *find_mpeg_stream(const unsigned char *data, const size_t len, uns
             continue;
         }
 
-        /* OK, found something which might be a header.... */
-        if (!mpeg_hdr_parse(stream_start, &H)) {
-            p = stream_start + 1;
-            continue;
-        }
-
-        /* See how many frames we get. */
-        nframes = 0;
-        q = stream_start;
-        do {
-            int delta;
-            ++nframes;
-            delta = mpeg_hdr_nextframe_offset(&H);
-            if (delta == 0)
-                return q + 1;
-            q += delta;
-        } while (nframes < MIN_MPEG_EXTENT && q < data + len - 4 && mpeg_hdr_parse(q, &H));
-
-        if (nframes >= MIN_MPEG_EXTENT) {
-            /* got some data. */
-/*            printf("stream_start = %p, q = %p, len = %d\n", stream_start, q, q - stream_start);*/
-            *mpegdata = stream_start;
-            *mpeglen = q - stream_start;
+        memset(&S, 0, sizeof S);
+        q = check_mpeg_stream(stream_start, len - (stream_start - data), &S, mpegdata, mpeglen);
+        if (q != stream_start + 1)
             return q;
-        } else
-            return stream_start;
+        p = q;
     }
 
     return p;
@@ -0,0 +1,296 @@
+/*
+ * batch.c:
+ * Read a whole collection of dump files -- a directory of them, or those
+ * matching a wildcard -- with a pool of threads.
+ *
+ * The files are divided into jobs, which are dealt out in turn to the
+ * threads' queues; a thread which runs out of work of its own takes jobs from
+ * the back of somebody else's queue. Normally each job is one file, which the
+ * thread reads with its own worker, flushing its connections at the end.
+ * With -c, files which carry on from one another in time -- the successive
+ * files of a capture rotation -- go into the same job, and are read one after
+ * the other without flushing the connections in between, so that connections
+ * which span several files are reassembled whole.
+ *
+ * Copyright (c) 2004 Chris Lightfoot. All rights reserved.
+ * Email: chris@ex-parrot.com; WWW: http://www.ex-parrot.com/~chris/
+ *
+ */
+
+static const char rcsid[] = "$Id$";
+
+#include <sys/types.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <glob.h>
+#include <pcap.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/stat.h>
+
+#include "driftnet.h"
+
+extern int verbose;         /* in driftnet.c */
+extern sig_atomic_t foad;   /* in driftnet.c */
+
+/* struct batchfile:
+ * A dump file, and the times of the first and last packets in it, if we
+ * know them. */
+struct batchfile {
+    char *name;
+    int linktype;
+    time_t first, last;
+};
+
+/* struct batchjob:
+ * Files to be read one after another by the same worker. */
+struct batchjob {
+    struct batchfile **files;
+    int nfiles;
+    time_t last;
+};
+
+/* struct jobqueue:
+ * One thread's queue of jobs. The owner takes jobs from the head; others
+ * steal them from the tail. */
+struct jobqueue {
+    pthread_mutex_t mtx;
+    struct batchjob **jobs;
+    int head, tail;
+};
+
+static struct batchfile *files;
+static int nfiles;
+static struct batchjob *jobs;
+static int njobs;
+static struct jobqueue *queues;
+static int nqueues;
+
+/* is_regular_file NAME
+ * Is NAME an ordinary file? */
+static int is_regular_file(const char *name) {
+    struct stat st;
+    return stat(name, &st) == 0 && S_ISREG(st.st_mode);
+}
+
+static void add_file(const char *name) {
+    static int alloc;
+    if (nfiles == alloc) {
+        alloc = alloc ? alloc * 2 : 64;
+        files = xrealloc(files, alloc * sizeof *files);
+    }
+    files[nfiles].name = xstrdup(name);
+    files[nfiles].linktype = -1;
+    files[nfiles].first = files[nfiles].last = 0;
+    ++nfiles;
+}
+
+static int compare_names(const void *a, const void *b) {
+    return strcmp(((const struct batchfile*)a)->name, ((const struct batchfile*)b)->name);
+}
+
+static int compare_times(const void *a, const void *b) {
+    const struct batchfile *A = *(const struct batchfile**)a, *B = *(const struct batchfile**)b;
+    if (A->first != B->first)
+        return A->first < B->first ? -1 : 1;
+    return strcmp(A->name, B->name);
+}
+
+/* list_directory NAME
+ * Add all the ordinary files in directory NAME, in order of name. Returns 0
+ * on success or -1 on failure. */
+static int list_directory(const char *dir) {
+    DIR *d;
+    struct dirent *de;
+
+    if (!(d = opendir(dir))) {
+        fprintf(stderr, PROGNAME": %s: %s\n", dir, strerror(errno));
+        return -1;
+    }
+    while ((de = readdir(d))) {
+        char *name;
+        if (*de->d_name == '.')
+            continue;
+        name = xmalloc(strlen(dir) + strlen(de->d_name) + 2);
+        sprintf(name, "%s/%s", dir, de->d_name);
+        if (is_regular_file(name))
+            add_file(name);
+        xfree(name);
+    }
+    closedir(d);
+
+    qsort(files, nfiles, sizeof *files, compare_names);
+    return 0;
+}
+
+/* make_jobs MAXGAP
+ * Divide the files into jobs. If MAXGAP is negative, each file is a job of
+ * its own; otherwise a file whose first packet comes no more than MAXGAP
+ * seconds after the last packet of another file (with the same link type) is
+ * treated as carrying on from it. */
+static void make_jobs(const int maxgap) {
+    struct batchfile **order;
+    int i;
+
+    jobs = xcalloc(nfiles, sizeof *jobs);
+    njobs = 0;
+
+    if (maxgap < 0) {
+        for (i = 0; i < nfiles; ++i) {
+            jobs[njobs].files = xmalloc(sizeof *jobs[njobs].files);
+            jobs[njobs].files[0] = files + i;
+            jobs[njobs++].nfiles = 1;
+        }
+        return;
+    }
+
+    /* Find out when each file starts and finishes. */
+    for (i = 0; i < nfiles; ++i) {
+        struct pcapfile *F;
+        if (!(F = pcapfile_open(files[i].name, NULL)))
+            continue;
+        if (pcapfile_timespan(F, &files[i].first, &files[i].last) == 0)
+            files[i].linktype = pcapfile_datalink(F);
+        pcapfile_close(F);
+    }
+
+    /* Take the files in order of starting time, and put each one after the
+     * job which finished most recently before it started, if that's close
+     * enough. Files whose times we don't know get jobs of their own. */
+    order = xmalloc(nfiles * sizeof *order);
+    for (i = 0; i < nfiles; ++i)
+        order[i] = files + i;
+    qsort(order, nfiles, sizeof *order, compare_times);
+
+    for (i = 0; i < nfiles; ++i) {
+        struct batchfile *f = order[i];
+        struct batchjob *J = NULL;
+        int j;
+
+        if (f->linktype != -1)
+            for (j = 0; j < njobs; ++j) {
+                struct batchjob *K = jobs + j;
+                if (K->files[K->nfiles - 1]->linktype == f->linktype
+                    && K->last <= f->first && f->first - K->last <= maxgap
+                    && (!J || K->last > J->last))
+                    J = K;
+            }
+
+        if (!J)
+            J = jobs + njobs++;
+        J->files = xrealloc(J->files, (J->nfiles + 1) * sizeof *J->files);
+        J->files[J->nfiles++] = f;
+        J->last = f->last;
+    }
+    xfree(order);
+}
+
+/* batch_open SPEC THREADS MAXGAP
+ * If SPEC, the argument of -f, names a directory or is a wildcard pattern,
+ * find the files it refers to and divide them among THREADS threads; MAXGAP
+ * is as for make_jobs. Returns 1 if so, 0 if SPEC is an ordinary dump file,
+ * or -1 on error. */
+int batch_open(const char *spec, const int nthreads, const int maxgap) {
+    struct stat st;
+    int i;
+
+    if (stat(spec, &st) == 0 && S_ISDIR(st.st_mode)) {
+        if (list_directory(spec) == -1)
+            return -1;
+    } else if (stat(spec, &st) == -1 && strpbrk(spec, "*?[")) {
+        glob_t g;
+        size_t k;
+        if (glob(spec, 0, NULL, &g) == 0) {
+            for (k = 0; k < g.gl_pathc; ++k)
+                if (is_regular_file(g.gl_pathv[k]))
+                    add_file(g.gl_pathv[k]);
+            globfree(&g);
+        }
+    } else
+        return 0;
+
+    if (nfiles == 0) {
+        fprintf(stderr, PROGNAME": %s: no dump files found\n", spec);
+        return -1;
+    }
+
+    make_jobs(maxgap);
+
+    /* Deal the jobs out. */
+    nqueues = nthreads;
+    queues = xcalloc(nqueues, sizeof *queues);
+    for (i = 0; i < nqueues; ++i) {
+        pthread_mutex_init(&queues[i].mtx, NULL);
+        queues[i].jobs = xmalloc((njobs / nqueues + 1) * sizeof *queues[i].jobs);
+    }
+    for (i = 0; i < njobs; ++i) {
+        struct jobqueue *Q = queues + i % nqueues;
+        Q->jobs[Q->tail++] = jobs + i;
+    }
+
+    if (verbose)
+        fprintf(stderr, PROGNAME": %d dump files in %d jobs, for %d threads\n", nfiles, njobs, nthreads);
+
+    return 1;
+}
+
+/* next_job ID
+ * Return the next job for thread ID: from its own queue if possible, and
+ * otherwise from someone else's; or NULL if there is nothing left to do. */
+static struct batchjob *next_job(const int id) {
+    struct batchjob *J = NULL;
+    int i;
+
+    for (i = 0; i < nqueues && !J; ++i) {
+        struct jobqueue *Q = queues + (id + i) % nqueues;
+        pthread_mutex_lock(&Q->mtx);
+        if (Q->head < Q->tail)
+            J = i == 0 ? Q->jobs[Q->head++] : Q->jobs[--Q->tail];
+        pthread_mutex_unlock(&Q->mtx);
+    }
+
+    return J;
+}
+
+/* batch_thread WORKER
+ * Thread which reads dump files for WORKER until there are none left. */
+void *batch_thread(void *v) {
+    worker w = (worker)v;
+    struct batchjob *J;
+
+    while (!foad && (J = next_job(w->id))) {
+        int i;
+
+        for (i = 0; i < J->nfiles && !foad; ++i) {
+            int linktype;
+
+            if (verbose)
+                fprintf(stderr, PROGNAME": worker %d: reading %s\n", w->id, J->files[i]->name);
+            if ((linktype = open_dump_file(w, J->files[i]->name)) == -1)
+                continue;
+            w->pkt_offset = get_link_level_hdr_length(linktype);
+
+            while (!foad && dispatch_dump_file(w) > 0)
+                sweep_connections(w);
+
+            close_dump_file(w);
+            ++w->nfiles;
+        }
+
+        /* Nothing else will carry on from the end of this job, and the next
+         * may start earlier, so its clock starts afresh; the connections
+         * which finished in this one mean nothing to it. */
+        flush_connections(w);
+        conntable_forget_graves(w->connections);
+        w->now = 0;
+    }
+
+    gettimeofday(&w->finish, NULL);
+    w->finished = 1;
+    return NULL;
+}
@@ -19,90 +19,256 @@ static const char rcsid[] = "$Id: connection.c,v 1.7 2003/10/16 11:56:37 chris E
 
 #include "driftnet.h"
 
-/* connection_new SOURCE DEST SPORT DPORT
- * Allocate a new connection structure for data sent from SOURCE:SPORT to
- * DEST:DPORT. */
-connection connection_new(const struct in_addr *src, const struct in_addr *dst, const short int sport, const short int dport) {
+/* The smallest buffer we allocate for a block, and below which we don't
+ * shrink one. */
+#define BLOCK_ALLOC0    4096
+
+/* connection_new SLAB POOL SOURCE DEST SPORT DPORT NOW
+ * Allocate from SLAB a new connection structure for data sent from
+ * SOURCE:SPORT to DEST:DPORT, created at time NOW, whose buffers will come
+ * from POOL. Nothing is allocated for the data until some arrive, so a
+ * connection which never carries any costs only the structure. */
+connection connection_new(slab S, bufpool P, const struct in_addr *src, const struct in_addr *dst, const short int sport, const short int dport, const time_t now) {
     connection c;
-    alloc_struct(_connection, c);
+    c = slab_alloc(S);
+    c->connslab = S;
+    c->pool = P;
     c->src = *src;
     c->dst = *dst;
     c->sport = sport;
     c->dport = dport;
-    c->alloc = 16384;
-    c->data = xmalloc(c->alloc);
-    c->last = time(NULL);
-    c->blocks = NULL;
+    c->last = now;
+    c->sigs = SIG_ALL;
     return c;
 }
 
 /* connection_delete CONNECTION
- * Free CONNECTION. */
+ * Free CONNECTION, giving its buffers back to the pool they came from. */
 void connection_delete(connection c) {
-    struct datablock *b;
-    for (b = c->blocks; b;) {
-        struct datablock *b2;
-        b2 = b->next;
-        free(b);
-        b = b2;
-    }
-    free(c->data);
-    free(c);
+    int i;
+    httpresp_delete(c);
+    for (i = 0; i < c->nblocks; ++i)
+        bufpool_put(c->pool, c->blocks[i].data, c->blocks[i].alloc);
+    bufpool_put(c->pool, c->blocks, c->nblocksalloc * sizeof *c->blocks);
+    slab_free(c->connslab, c);
 }
 
-/* connection_push CONNECTION DATA OFFSET LENGTH
- * Add LENGTH bytes of DATA received at OFFSET in the stream to CONNECTION. */
-void connection_push(connection c, const unsigned char *data, unsigned int off, unsigned int len) {
-    struct datablock *B, *b, *bl, BZ = {0};
-    int a;
-
-    assert(c->alloc > 0);
-    if (off + len > c->alloc) {
-        /* Allocate more memory. */
-        do 
-            c->alloc *= 2;
-        while (off + len > c->alloc);
-        c->data = (unsigned char*)xrealloc(c->data, c->alloc);
+/* find_block CONNECTION OFFSET
+ * Return the index of the first of CONNECTION's blocks which ends at or after
+ * OFFSET, or the number of blocks if there is none. */
+static int find_block(connection c, const unsigned int off) {
+    int lo = 0, hi = c->nblocks;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if ((unsigned int)(c->blocks[mid].off + c->blocks[mid].len) < off)
+            lo = mid + 1;
+        else
+            hi = mid;
     }
+    return lo;
+}
 
-    memcpy(c->data + off, data, len);
+/* block_alloc CONNECTION BLOCK LEN
+ * Make sure that BLOCK, one of CONNECTION's, has room for LEN bytes. Buffers
+ * come from the connection's pool in sizes which are powers of two, so one
+ * which grows doubles in size each time. */
+static void block_alloc(connection c, struct datablock *b, const unsigned int len) {
+    size_t n;
+    if ((unsigned int)b->alloc >= len)
+        return;
+    n = b->alloc;
+    b->data = bufpool_resize(c->pool, b->data, &n, b->len, len < BLOCK_ALLOC0 ? BLOCK_ALLOC0 : len);
+    b->alloc = n;
+}
 
-    if (off + len > c->len) c->len = off + len;
-    c->last = time(NULL);
-    
-    B = xmalloc(sizeof *B);
-    *B = BZ;
-    B->off = off;
-    B->len = len;
-    B->dirty = 1;
-    B->next = NULL;
-    
-    /* Insert the block into the sorted block list. */
-    for (b = c->blocks, bl = NULL; ; bl = b, b = b->next) {
-        if ((!b || off <= b->off) && (!bl || off > bl->off)) {
-            B->next = b;
-            if (bl)
-                bl->next = B;
-            else
-                c->blocks = B;
-            break;
+/* connection_push CONNECTION DATA OFFSET LENGTH NOW
+ * Add LENGTH bytes of DATA received at OFFSET in the stream at time NOW to
+ * CONNECTION. Bytes which we already have, as from a retransmission, are
+ * left as they are. Returns the number of bytes which were new.
+ *
+ * Each block has its own buffer, so data which arrive far ahead of the rest
+ * of the stream cost only their own size, and when the stream grows only the
+ * buffer of the block at its end need be enlarged. When a gap is filled, the
+ * blocks on either side of it are copied into the first. */
+unsigned int connection_push(connection c, const unsigned char *data, unsigned int off, unsigned int len, const time_t now) {
+    struct datablock *b, BZ = {0};
+    unsigned int end = off + len, start, p, fresh = 0;
+    int i, j, k;
+
+    c->last = now;
+
+    /* The blocks are kept in order and never touch one another, so the new
+     * data overlap or abut the blocks from i up to but not including k. */
+    i = find_block(c, off);
+    for (k = i; k < c->nblocks && (unsigned int)c->blocks[k].off <= end; ++k);
+
+    /* Nothing new, so nothing to copy and nothing to search again. */
+    if (k > i && (unsigned int)c->blocks[i].off <= off && (unsigned int)(c->blocks[i].off + c->blocks[i].len) >= end)
+        return 0;
+
+    if (k == i) {
+        /* A block on its own. */
+        if (c->nblocks == c->nblocksalloc) {
+            size_t n = c->nblocksalloc * sizeof *c->blocks;
+            c->blocks = bufpool_resize(c->pool, c->blocks, &n, n, (c->nblocksalloc ? 2 * c->nblocksalloc : 4) * sizeof *c->blocks);
+            c->nblocksalloc = n / sizeof *c->blocks;
+        }
+        memmove(c->blocks + i + 1, c->blocks + i, (c->nblocks - i) * sizeof *c->blocks);
+        ++c->nblocks;
+        b = c->blocks + i;
+        *b = BZ;
+        block_alloc(c, b, len);
+        memcpy(b->data, data, len);
+        b->off = off;
+        b->len = fresh = len;
+    } else {
+        /* Combine the new data with those blocks into the first of them. The
+         * media parsers' offsets and state are relative to the start of the
+         * block, so they remain good unless the new data extend it
+         * backwards, in which case it must be searched again. */
+        b = c->blocks + i;
+        start = off < (unsigned int)b->off ? off : b->off;
+        if (c->blocks[k - 1].off + c->blocks[k - 1].len > end)
+            end = c->blocks[k - 1].off + c->blocks[k - 1].len;
+        block_alloc(c, b, end - start);
+        if (start < (unsigned int)b->off)
+            memmove(b->data + (b->off - start), b->data, b->len);
+        for (j = i + 1; j < k; ++j) {
+            memcpy(b->data + (c->blocks[j].off - start), c->blocks[j].data, c->blocks[j].len);
+            bufpool_put(c->pool, c->blocks[j].data, c->blocks[j].alloc);
+        }
+
+        /* Copy only the parts of the new data which fall in the gaps between
+         * those blocks. */
+        for (p = off, j = i; p < off + len; ) {
+            unsigned int q = off + len;
+            if (j < k && (unsigned int)c->blocks[j].off <= p) {
+                if ((unsigned int)(c->blocks[j].off + c->blocks[j].len) > p)
+                    p = c->blocks[j].off + c->blocks[j].len;
+                ++j;
+                continue;
+            }
+            if (j < k && (unsigned int)c->blocks[j].off < q)
+                q = c->blocks[j].off;
+            memcpy(b->data + (p - start), data + (p - off), q - p);
+            fresh += q - p;
+            p = q;
+        }
+
+        if (start < (unsigned int)b->off) {
+            unsigned char *d = b->data;
+            int a = b->alloc;
+            *b = BZ;
+            b->data = d;
+            b->alloc = a;
+            b->off = start;
         }
+        b->len = end - start;
+        memmove(b + 1, c->blocks + k, (c->nblocks - k) * sizeof *c->blocks);
+        c->nblocks -= k - i - 1;
     }
+    b->dirty = 1;
 
-    /* Now go through the list combining blocks. */
-    do {
-        a = 0;
-        for (b = c->blocks; b; b = b->next) {
-            if (b->next && b->off + b->len >= b->next->off) {
-                struct datablock *bb;
-                bb = b->next;
-                b->len = (bb->off + bb->len) - b->off;
-                b->next = bb->next;
-                b->dirty = 1;
-                free(bb);
-                ++a;
+    if (off + len > c->len) c->len = off + len;
+
+    return fresh;
+}
+
+/* connection_discard CONNECTION OFFSET
+ * Throw away the data before OFFSET in CONNECTION, so that offsets are
+ * thereafter counted from OFFSET. Media parsers which were in the middle of
+ * an object which started before OFFSET have to give up on it. */
+void connection_discard(connection c, unsigned int upto) {
+    int i, j;
+
+    if (upto > c->len)
+        upto = c->len;
+    if (upto == 0)
+        return;
+
+    for (i = 0; i < c->nblocks && (unsigned int)(c->blocks[i].off + c->blocks[i].len) <= upto; ++i)
+        bufpool_put(c->pool, c->blocks[i].data, c->blocks[i].alloc);
+    memmove(c->blocks, c->blocks + i, (c->nblocks - i) * sizeof *c->blocks);
+    c->nblocks -= i;
+
+    for (i = 0; i < c->nblocks; ++i) {
+        struct datablock *b = c->blocks + i;
+        if ((unsigned int)b->off < upto) {
+            int d = upto - b->off, n;
+            memmove(b->data, b->data + d, b->len - d);
+            b->off += d;
+            b->len -= d;
+            for (j = 0; j < NMEDIATYPES; ++j) {
+                b->moff[j] = b->moff[j] > d ? b->moff[j] - d : 0;
+                if (b->mstate[j].start < d)
+                    memset(b->mstate + j, 0, sizeof b->mstate[j]);
+                else
+                    b->mstate[j].start -= d;
+            }
+
+            /* Give back memory we no longer need. */
+            for (n = b->alloc; n > BLOCK_ALLOC0 && b->len <= n / 4; n /= 2);
+            if (n != b->alloc) {
+                size_t a = b->alloc;
+                b->data = bufpool_resize(c->pool, b->data, &a, b->len, n);
+                b->alloc = a;
             }
         }
-    } while (a);
+        b->off -= upto;
+    }
+
+    c->len -= upto;
+    c->isn += upto;
+    c->discarded += upto;
+    if (c->http)
+        httpresp_discard(c, upto);
+}
+
+/* connection_data CONNECTION OFFSET LENGTH
+ * Return a pointer to the byte at OFFSET in CONNECTION's stream, and set
+ * *LENGTH to the number of bytes we have from there on before the next gap;
+ * or, if we don't have that byte, return NULL and set *LENGTH to zero. */
+unsigned char *connection_data(connection c, const unsigned int off, unsigned int *len) {
+    int i = find_block(c, off);
+    struct datablock *b = c->blocks + i;
+    if (i < c->nblocks && (unsigned int)b->off <= off && off < (unsigned int)(b->off + b->len)) {
+        *len = b->off + b->len - off;
+        return b->data + (off - b->off);
+    }
+    *len = 0;
+    return NULL;
+}
+
+/* connqueue_push QUEUE CONNECTION
+ * Put CONNECTION at the tail of QUEUE, taking it off any queue of the same
+ * kind it is already on (which may be QUEUE itself). */
+void connqueue_push(struct connqueue *Q, connection c) {
+    int i = Q->which;
+    connqueue_remove(i, c);
+    c->qprev[i] = Q->tail;
+    c->qnext[i] = NULL;
+    if (Q->tail)
+        Q->tail->qnext[i] = c;
+    else
+        Q->head = c;
+    Q->tail = c;
+    c->queue[i] = Q;
 }
 
+/* connqueue_remove WHICH CONNECTION
+ * Take CONNECTION off whichever queue of kind WHICH it is on, if any. */
+void connqueue_remove(const int which, connection c) {
+    struct connqueue *Q;
+    if (!(Q = c->queue[which]))
+        return;
+    if (c->qprev[which])
+        c->qprev[which]->qnext[which] = c->qnext[which];
+    else
+        Q->head = c->qnext[which];
+    if (c->qnext[which])
+        c->qnext[which]->qprev[which] = c->qprev[which];
+    else
+        Q->tail = c->qprev[which];
+    c->qprev[which] = c->qnext[which] = NULL;
+    c->queue[which] = NULL;
+}
@@ -0,0 +1,337 @@
+/*
+ * conntable.c:
+ * Table of connections, indexed by source and destination address and port.
+ *
+ * This is a hash table using open addressing with linear probing. The key is
+ * stored inline in each slot along with its hash value, so that a probe only
+ * has to look at the connection object itself once it has found the right
+ * slot. When the table fills up we allocate a bigger one, but rather than
+ * rehashing everything at once we move entries across a few slots at a time
+ * on each subsequent insertion, so that no one packet pays for the whole
+ * lot; until the move is finished, lookups look in both tables.
+ *
+ * The table also remembers, for a while, connections which have finished,
+ * much as TCP's TIME_WAIT state does, so that segments which arrive for them
+ * late don't start new connections. These are kept in a fixed-size array,
+ * in sets of a few indexed by hash, where a new entry replaces the oldest in
+ * its set; losing one costs no more than a spurious connection.
+ *
+ * Copyright (c) 2004 Chris Lightfoot. All rights reserved.
+ * Email: chris@ex-parrot.com; WWW: http://www.ex-parrot.com/~chris/
+ *
+ */
+
+static const char rcsid[] = "$Id$";
+
+#include <sys/types.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "driftnet.h"
+
+/* Number of slots of the old table to move across on each insertion while
+ * the table is being resized. This must be big enough that the move is
+ * complete before the new table needs to grow in its turn. */
+#define MIGRATE_STEP    4
+
+/* Marks a slot whose connection has been removed. Probes must continue past
+ * such slots, but insertions may reuse them. */
+static char tombstone_marker;
+#define TOMBSTONE       ((connection)&tombstone_marker)
+
+/* struct connkey:
+ * The addresses and ports which identify a half-connection, packed. */
+struct connkey {
+    uint32_t src, dst;
+    uint16_t sport, dport;
+};
+
+/* struct connslot:
+ * A slot in the table; c is NULL if the slot has never been used. */
+struct connslot {
+    struct connkey key;
+    uint32_t hash;
+    connection c;
+};
+
+/* struct slotarray:
+ * An array of slots, of a power-of-two size, with counts of the slots which
+ * hold connections and of those which are tombstones. */
+struct slotarray {
+    struct connslot *slots;
+    unsigned int size, used, dead;
+};
+
+/* How many finished connections we remember, in sets of how many, for how
+ * many seconds, and how far beyond the data we saw a late segment may
+ * start. */
+#define NGRAVES         4096
+#define GRAVE_WAYS      4
+#define GRAVE_TIME      60
+#define GRAVE_SLACK     65536
+
+/* struct grave:
+ * A finished connection; the sequence numbers of the data we saw on it run
+ * from lo to hi, unless any is set, in which case we want none of it. */
+struct grave {
+    struct connkey key;
+    uint32_t lo, hi;
+    int any;
+    time_t when;
+};
+
+struct _conntable {
+    /* All insertions go into cur. While the table is being resized, old is
+     * the previous array; slots below migrated have already been moved. */
+    struct slotarray cur, old;
+    unsigned int migrated;
+    uint32_t seed;
+    /* Finished connections, allocated when the first one finishes. */
+    struct grave *graves;
+};
+
+/* make_key SOURCE DEST SPORT DPORT KEY
+ * Fill in KEY from the given addresses and ports. */
+static void make_key(const struct in_addr *src, const struct in_addr *dst, const short int sport, const short int dport, struct connkey *k) {
+    k->src = src->s_addr;
+    k->dst = dst->s_addr;
+    k->sport = (uint16_t)sport;
+    k->dport = (uint16_t)dport;
+}
+
+/* hash_key TABLE KEY
+ * Return a hash of KEY. The seed is chosen when the table is created, so that
+ * an attacker can't easily arrange for lots of connections to collide. */
+static uint32_t hash_key(const conntable T, const struct connkey *k) {
+    uint64_t h;
+    h = (((uint64_t)k->src << 32) | k->dst) ^ T->seed;
+    h *= 0x9e3779b97f4a7c15ULL;
+    h ^= ((uint64_t)k->sport << 16) | k->dport;
+    h *= 0xc2b2ae3d27d4eb4fULL;
+    h ^= h >> 31;
+    return (uint32_t)(h >> 16);
+}
+
+static int key_equal(const struct connkey *a, const struct connkey *b) {
+    return a->src == b->src && a->dst == b->dst && a->sport == b->sport && a->dport == b->dport;
+}
+
+/* slotarray_alloc ARRAY SIZE
+ * Allocate SIZE empty slots in ARRAY. */
+static void slotarray_alloc(struct slotarray *A, const unsigned int size) {
+    A->slots = xcalloc(size, sizeof *A->slots);
+    A->size = size;
+    A->used = A->dead = 0;
+}
+
+/* slotarray_lookup ARRAY KEY HASH
+ * Return the slot in ARRAY holding a connection with KEY, or NULL. */
+static struct connslot *slotarray_lookup(struct slotarray *A, const struct connkey *k, const uint32_t hash) {
+    unsigned int i, mask;
+    mask = A->size - 1;
+    for (i = hash & mask; A->slots[i].c; i = (i + 1) & mask) {
+        struct connslot *S = A->slots + i;
+        if (S->c != TOMBSTONE && S->hash == hash && key_equal(&S->key, k))
+            return S;
+    }
+    return NULL;
+}
+
+/* slotarray_insert ARRAY KEY HASH CONNECTION
+ * Put CONNECTION in the first free slot in ARRAY on the probe sequence for
+ * HASH. There must be a free slot. */
+static void slotarray_insert(struct slotarray *A, const struct connkey *k, const uint32_t hash, connection c) {
+    unsigned int i, mask;
+    mask = A->size - 1;
+    for (i = hash & mask; A->slots[i].c && A->slots[i].c != TOMBSTONE; i = (i + 1) & mask);
+    if (A->slots[i].c == TOMBSTONE)
+        --A->dead;
+    A->slots[i].key = *k;
+    A->slots[i].hash = hash;
+    A->slots[i].c = c;
+    ++A->used;
+}
+
+/* migrate TABLE COUNT
+ * Move up to COUNT slots' worth of connections from the old array of TABLE to
+ * the current one, freeing the old array once it is empty. */
+static void migrate(conntable T, unsigned int n) {
+    while (n-- > 0 && T->migrated < T->old.size) {
+        struct connslot *S = T->old.slots + T->migrated++;
+        /* The old slot becomes a tombstone rather than empty, since other
+         * entries' probe sequences may run through it. */
+        if (S->c && S->c != TOMBSTONE) {
+            slotarray_insert(&T->cur, &S->key, S->hash, S->c);
+            S->c = TOMBSTONE;
+        }
+    }
+    if (T->old.slots && T->migrated == T->old.size) {
+        xfree(T->old.slots);
+        T->old.slots = NULL;
+        T->old.size = 0;
+    }
+}
+
+/* conntable_new:
+ * Allocate a new, empty table of connections. */
+conntable conntable_new(void) {
+    conntable T;
+    alloc_struct(_conntable, T);
+    slotarray_alloc(&T->cur, 64);
+    T->seed = (uint32_t)time(NULL) ^ ((uint32_t)getpid() << 16) ^ (uint32_t)(size_t)T;
+    return T;
+}
+
+/* conntable_delete TABLE
+ * Free TABLE, but not the connections in it. */
+void conntable_delete(conntable T) {
+    xfree(T->cur.slots);
+    xfree(T->old.slots);
+    xfree(T->graves);
+    xfree(T);
+}
+
+/* conntable_find TABLE SOURCE DEST SPORT DPORT
+ * Return the connection in TABLE from SOURCE:SPORT to DEST:DPORT, or NULL if
+ * there isn't one. */
+connection conntable_find(conntable T, const struct in_addr *src, const struct in_addr *dst, const short int sport, const short int dport) {
+    struct connkey k;
+    struct connslot *S;
+    uint32_t hash;
+
+    make_key(src, dst, sport, dport, &k);
+    hash = hash_key(T, &k);
+    if ((S = slotarray_lookup(&T->cur, &k, hash)))
+        return S->c;
+    else if (T->old.slots && (S = slotarray_lookup(&T->old, &k, hash)))
+        return S->c;
+    else
+        return NULL;
+}
+
+/* conntable_insert TABLE CONNECTION
+ * Add CONNECTION, which must not already be present, to TABLE. */
+void conntable_insert(conntable T, connection c) {
+    struct connkey k;
+
+    if (T->old.slots)
+        migrate(T, MIGRATE_STEP);
+
+    /* Keep the table no more than three-quarters full, counting tombstones.
+     * If it's mostly tombstones we rebuild it at the same size. */
+    if ((T->cur.used + T->cur.dead + 1) * 4 > T->cur.size * 3) {
+        if (T->old.slots)
+            migrate(T, T->old.size);
+        T->old = T->cur;
+        T->migrated = 0;
+        slotarray_alloc(&T->cur, T->old.used * 2 >= T->old.size ? T->old.size * 2 : T->old.size);
+        migrate(T, MIGRATE_STEP);
+    }
+
+    make_key(&c->src, &c->dst, c->sport, c->dport, &k);
+    slotarray_insert(&T->cur, &k, hash_key(T, &k), c);
+}
+
+/* conntable_remove TABLE CONNECTION
+ * Remove CONNECTION from TABLE, but don't free it. */
+void conntable_remove(conntable T, connection c) {
+    struct connkey k;
+    struct connslot *S;
+    uint32_t hash;
+
+    make_key(&c->src, &c->dst, c->sport, c->dport, &k);
+    hash = hash_key(T, &k);
+    if ((S = slotarray_lookup(&T->cur, &k, hash))) {
+        S->c = TOMBSTONE;
+        --T->cur.used;
+        ++T->cur.dead;
+    } else if (T->old.slots && (S = slotarray_lookup(&T->old, &k, hash)))
+        S->c = TOMBSTONE;
+}
+
+/* conntable_next TABLE POSITION
+ * Iterate over the connections in TABLE. *POSITION should be zero on the
+ * first call; returns each connection in turn and then NULL. Connections may
+ * be removed, but not inserted, during the iteration. */
+connection conntable_next(conntable T, unsigned int *pos) {
+    while (*pos < T->cur.size) {
+        connection c = T->cur.slots[(*pos)++].c;
+        if (c && c != TOMBSTONE)
+            return c;
+    }
+    if (T->old.slots) {
+        while (*pos < T->cur.size + T->old.size) {
+            connection c = T->old.slots[(*pos)++ - T->cur.size].c;
+            if (c && c != TOMBSTONE)
+                return c;
+        }
+    }
+    return NULL;
+}
+
+/* conntable_bury TABLE CONNECTION NOW
+ * Remember that CONNECTION, which is in TABLE, finished at time NOW. */
+void conntable_bury(conntable T, connection c, const time_t now) {
+    struct grave *set, *g;
+    struct connkey k;
+    int i;
+
+    if (!T->graves)
+        T->graves = xcalloc(NGRAVES, sizeof *T->graves);
+    make_key(&c->src, &c->dst, c->sport, c->dport, &k);
+
+    /* Use the entry for this connection if there is one, or else the
+     * oldest. */
+    set = T->graves + (hash_key(T, &k) & (NGRAVES - GRAVE_WAYS));
+    for (g = set, i = 0; i < GRAVE_WAYS; ++i) {
+        if (key_equal(&set[i].key, &k)) {
+            g = set + i;
+            break;
+        } else if (set[i].when < g->when)
+            g = set + i;
+    }
+
+    g->key = k;
+    g->lo = c->isn - (uint32_t)c->discarded;
+    g->hi = c->isn + c->len;
+    g->any = c->ignored;
+    g->when = now;
+}
+
+/* conntable_forget_graves TABLE
+ * Forget the connections which have finished in TABLE, as when the time
+ * by which they were buried no longer applies. */
+void conntable_forget_graves(conntable T) {
+    xfree(T->graves);
+    T->graves = NULL;
+}
+
+/* conntable_buried TABLE SOURCE DEST SPORT DPORT SEQ NOW
+ * Is a segment with sequence number SEQ from SOURCE:SPORT to DEST:DPORT,
+ * arriving at time NOW, a late one for a connection which has finished? A
+ * connection we were ignoring may only have gone quiet, so each segment of it
+ * keeps it buried for another GRAVE_TIME. */
+int conntable_buried(conntable T, const struct in_addr *src, const struct in_addr *dst, const short int sport, const short int dport, const uint32_t seq, const time_t now) {
+    struct grave *g;
+    struct connkey k;
+    int i;
+
+    if (!T->graves)
+        return 0;
+    make_key(src, dst, sport, dport, &k);
+    g = T->graves + (hash_key(T, &k) & (NGRAVES - GRAVE_WAYS));
+    for (i = 0; i < GRAVE_WAYS; ++i, ++g)
+        if (key_equal(&g->key, &k)) {
+            if (now - g->when > GRAVE_TIME)
+                return 0;
+            else if (g->any) {
+                g->when = now;
+                return 1;
+            } else
+                return seq - g->lo <= g->hi - g->lo + GRAVE_SLACK;
+        }
+    return 0;
+}
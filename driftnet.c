@@ -26,6 +26,7 @@ static const char rcsid[] = "$Id: driftnet.c,v 1.32 2003/10/16 11:56:37 chris Ex
 
 #include <ctype.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
@@ -33,6 +34,7 @@ static const char rcsid[] = "$Id: driftnet.c,v 1.32 2003/10/16 11:56:37 chris Ex
 #include <stdio.h>
 #include <signal.h>
 #include <time.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
 
@@ -41,23 +43,46 @@ static const char rcsid[] = "$Id: driftnet.c,v 1.32 2003/10/16 11:56:37 chris Ex
 #define SNAPLEN 262144      /* largest chunk of data we accept from pcap */
 #define WRAPLEN 262144      /* out-of-order packet margin */
 
-/* slots for storing information about connections */
-connection *slots;
-unsigned int slotsused, slotsalloc;
+/* We don't search a connection for media every time data arrive for it, but
+ * wait until EXTRACT_THRESHOLD bytes have arrived (see -B), the sender pushes
+ * or finishes, or no more data have come for EXTRACT_DEADLINE seconds. */
+#define EXTRACT_THRESHOLD   16384
+#define EXTRACT_DEADLINE    1
+
+/* The most data we keep for any connection. Normally data are thrown away
+ * once the media parsers have finished with them, but if that doesn't happen,
+ * because of a gap in the stream which is never filled or an enormous object,
+ * we give up on the oldest data. */
+#define MAXCONNECTIONDATA   (8 * 1024 * 1024)
+
+/* The most memory all the connections' data may use between them (see -L).
+ * Each worker has an equal share, which must leave room for a few
+ * connections of the largest size. */
+#define MEMORY_LIMIT        (256 * 1024 * 1024)
+#define MIN_MEMORY_LIMIT    (4 * MAXCONNECTIONDATA)
+
+/* Packet capture threads. With the packet ring and -j, there is one for each
+ * socket in a PACKET_FANOUT group; with a dump file and -j, the file is
+ * shared among them; otherwise there's just one. */
+worker *workers;
+int nworkers = 1;
+
+/* When the capture threads were started. */
+struct timeval capture_start;
 
 /* flags: verbose, adjunct mode, temporary directory to use, media types to
  * extract, beep on image. */
 int extract_images = 1;
 int verbose, adjunct, beep;
+int timing;
+unsigned int extract_threshold = EXTRACT_THRESHOLD;
+size_t memory_limit = MEMORY_LIMIT;
 int tmpdir_specified;
 char *tmpdir;
 int max_tmpfiles;
 
 enum mediatype extract_type = m_image;
 
-/* ugh. */
-pcap_t *pc;
-
 #ifndef NO_DISPLAY_WINDOW
 /* PID of display child and file descriptor on pipe to same. */
 pid_t dpychld;
@@ -69,6 +94,7 @@ int dodisplay(int argc, char *argv[]);
 
 /* playaudio.c */
 void do_mpeg_player(void);
+void mpeg_alloc_stats(struct allocstats *objs, struct allocstats *bufs);
 
 /* clean_temporary_directory:
  * Ensure that our temporary directory is clear of any files. */
@@ -111,60 +137,179 @@ void clean_temporary_directory(void) {
         fprintf(stderr, PROGNAME": rmdir(%s): %s\n", tmpdir, strerror(errno));
 }
 
-/* alloc_connection:
- * Find a free slot in which to allocate a connection object. */
-connection *alloc_connection(void) {
-    connection *C;
-    for (C = slots; C < slots + slotsalloc; ++C) {
-        if (!*C) return C;
-    }
-    /* No connection slots left. */
-    slots = (connection*)xrealloc(slots, slotsalloc * 2 * sizeof(connection));
-    memset(slots + slotsalloc, 0, slotsalloc * sizeof(connection));
-    C = slots + slotsalloc;
-    slotsalloc *= 2;
-    return C;
+/* worker_new ID
+ * Allocate a new worker, with an empty connection table and no packet
+ * source. */
+worker worker_new(const int id) {
+    worker w;
+    alloc_struct(_worker, w);
+    w->id = id;
+    w->pcap_fd = -1;
+    w->connections = conntable_new();
+    w->pending.which = QUEUE_PENDING;
+    w->holding.which = QUEUE_DATA;
+    w->connslab = slab_new(sizeof(struct _connection));
+    w->pool = bufpool_new();
+    return w;
 }
 
-/* find_connection:
- * Find a connection running between the two named addresses. */
-connection *find_connection(const struct in_addr *src, const struct in_addr *dst, const short int sport, const short int dport) {
-    connection *C;
-    for (C = slots; C < slots + slotsalloc; ++C) {
-        connection c = *C;
-        if (c && c->sport == sport && c->dport == dport
-            && memcmp(&(c->src), src, sizeof(struct in_addr)) == 0
-            && memcmp(&(c->dst), dst, sizeof(struct in_addr)) == 0)
-            return C;
-    }
-    return NULL;
+/* worker_delete WORKER
+ * Close WORKER's packet source and free it and its connections. */
+void worker_delete(worker w) {
+    connection c;
+    unsigned int pos = 0;
+    if (w->ring)
+        packetring_close(w->ring);
+    else if (w->file && (!w->sharefile || w->id == 0))
+        pcapfile_close(w->file);    /* workers sharing a file share the first's */
+    else if (w->pc)
+        pcap_close(w->pc);
+    while ((c = conntable_next(w->connections, &pos)))
+        connection_delete(c);
+    conntable_delete(w->connections);
+    slab_delete(w->connslab);
+    bufpool_delete(w->pool);
+    xfree(w);
 }
 
+/* timing_now:
+ * Return the time in seconds, for measuring how long things take (-T). */
+double timing_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* extract_media WORKER CONNECTION
+ * Extract media from CONNECTION, keeping count of the time taken if asked
+ * to. */
+void extract_media(worker w, connection c) {
+    c->pending = 0;
+    connqueue_remove(QUEUE_PENDING, c);
+    if (timing) {
+        double t = timing_now();
+        connection_extract_media(c, extract_type);
+        w->t_extract += timing_now() - t;
+    } else
+        connection_extract_media(c, extract_type);
+    /* Once it has nothing left, there is no point in evicting it. */
+    if (!c->nblocks && !c->http)
+        connqueue_remove(QUEUE_DATA, c);
+}
 
-/* sweep_connections:
- * Free finished connection slots. */
+/* finish_media WORKER CONNECTION
+ * Extract whatever media we can from CONNECTION, which is about to be freed.
+ * If we were following HTTP responses in it, anything we were waiting for
+ * won't now arrive, so what there is of it is searched instead. */
+void finish_media(worker w, connection c) {
+    httpresp_abandon(c);
+    extract_media(w, c);
+}
+
+/* forget_connection WORKER CONNECTION
+ * Remove CONNECTION from WORKER's table and queues, and free it. */
+void forget_connection(worker w, connection c) {
+    conntable_remove(w->connections, c);
+    connqueue_remove(QUEUE_EXPIRY, c);
+    connqueue_remove(QUEUE_PENDING, c);
+    connqueue_remove(QUEUE_DATA, c);
+    connection_delete(c);
+}
+
+/* evict_connections WORKER CONNECTION
+ * While WORKER's connections hold more memory than its share of the limit,
+ * search those which have least recently had data for media and free them,
+ * sparing CONNECTION, which has just had some. Only connections which hold
+ * buffers are on the holding queue, so those we are ignoring are never
+ * considered. Those we do free are buried, so that the rest of them isn't
+ * taken for new connections. */
+void evict_connections(worker w, connection keep) {
+    while (bufpool_inuse(w->pool) > w->memory_limit) {
+        connection c;
+        size_t before;
+        char cs[CONNSTR_LEN];
+
+        if ((c = w->holding.head) == keep)
+            c = c->qnext[QUEUE_DATA];
+        if (!c)
+            break;
+
+        if (verbose)
+            fprintf(stderr, PROGNAME": memory limit reached (%lu Kbytes in use), dropping connection: %s\n",
+                    (unsigned long)(bufpool_inuse(w->pool) / 1024), connection_string(cs, c->src, c->sport, c->dst, c->dport));
+        finish_media(w, c);
+        before = bufpool_inuse(w->pool);
+        conntable_bury(w->connections, c, w->now);
+        forget_connection(w, c);
+        ++w->nevicted;
+        w->nevictedbytes += before - bufpool_inuse(w->pool);
+    }
+}
+
+/* sweep_connections WORKER
+ * Free finished connections in WORKER's table.
+ *
+ * We discard connections which have seen no activity for TIMEOUT, or for
+ * which a FIN has been seen and for which there are no gaps in the stream.
+ * Rather than examining every connection each time, process_packet keeps the
+ * worker's active queue in order of last activity by moving a connection to
+ * the tail whenever it sees a packet for it, and puts connections which meet
+ * the latter condition on the closing queue. So we need only look at
+ * connections which are actually due to be discarded.
+ *
+ * Connections whose search for media has been put off are kept on the
+ * pending queue in the same order, so we can find those which have gone
+ * EXTRACT_DEADLINE without data in the same way. */
 #define TIMEOUT 5
-#define MAXCONNECTIONDATA   (8 * 1024 * 1024)
 
-void sweep_connections(void) {
-    time_t now;
-    connection *C;
-    now = time(NULL);
-    for (C = slots; C < slots + slotsalloc; ++C) {
-        if (*C) {
-            connection c = *C;
-            /* We discard connections which have seen no activity for TIMEOUT
-             * or for which a FIN has been seen and for which there are no
-             * gaps in the stream, or where more than MAXCONNECTIONDATA have
-             * been captured. */
-            if ((now - c->last) > TIMEOUT
-                || (c->fin && (!c->blocks || !c->blocks->next))
-                || c->len > MAXCONNECTIONDATA) {
-                connection_extract_media(c, extract_type);
-                connection_delete(c);
-                *C = NULL;
-            }
-        }
+void sweep_connections(worker w) {
+    connection c;
+
+    while ((c = w->closing.head)) {
+        finish_media(w, c);
+        conntable_bury(w->connections, c, w->now);
+        forget_connection(w, c);
+    }
+
+    /* A connection we are ignoring which goes quiet for a while is still
+     * one we want to ignore when it carries on. */
+    while ((c = w->active.head) && (w->now - c->last) > TIMEOUT) {
+        finish_media(w, c);
+        if (c->ignored)
+            conntable_bury(w->connections, c, w->now);
+        forget_connection(w, c);
+    }
+
+    while ((c = w->pending.head) && (w->now - c->last) >= EXTRACT_DEADLINE)
+        extract_media(w, c);
+}
+
+/* report_memory WORKER
+ * With -v or -T, say every REPORT_INTERVAL seconds, by WORKER's clock, how
+ * much memory its connections are using for their data, and how many have
+ * been dropped to keep that within its share of the limit. */
+#define REPORT_INTERVAL 60
+
+void report_memory(worker w) {
+    if (!verbose && !timing)
+        return;
+    if (!w->lastreport)
+        w->lastreport = w->now;
+    else if (w->now - w->lastreport >= REPORT_INTERVAL) {
+        fprintf(stderr, PROGNAME": worker %d: %lu of %lu Kbytes in use for connection data, %lu connections dropped\n",
+                w->id, (unsigned long)(bufpool_inuse(w->pool) / 1024), (unsigned long)(w->memory_limit / 1024), w->nevicted);
+        w->lastreport = w->now;
+    }
+}
+
+/* flush_connections WORKER
+ * Extract whatever media we can from all of WORKER's connections, and free
+ * them. */
+void flush_connections(worker w) {
+    connection c;
+    while ((c = w->closing.head) || (c = w->active.head)) {
+        finish_media(w, c);
+        forget_connection(w, c);
     }
 }
 
@@ -273,13 +418,35 @@ void usage(FILE *fp) {
 "\n"
 "  -h               Display this help message.\n"
 "  -v               Verbose operation.\n"
+"  -T               On exit, report throughput, peak memory use and the time\n"
+"                   spent in each stage of processing.\n"
+"  -B bytes         Search a connection for media once this many bytes have\n"
+"                   arrived on it since it was last searched, unless the\n"
+"                   sender pushes or closes first (default %u; 0 means\n"
+"                   after every packet).\n"
+"  -L bytes         Keep the data of the connections being reassembled within\n"
+"                   this much memory, shared among the capture threads\n"
+"                   (default %u Mbytes). Beyond it, the connections least\n"
+"                   recently active are searched for media and dropped.\n"
 "  -b               Beep when a new image is captured.\n"
 "  -i interface     Select the interface on which to listen (default: all\n"
 "                   interfaces).\n"
 "  -f file          Instead of listening on an interface, read captured\n"
 "                   packets from a pcap dump file; file can be a named pipe\n"
-"                   for use with Kismet or similar.\n"
+"                   for use with Kismet or similar, or - for standard input.\n"
+"                   If file is a directory or a wildcard, read all the files\n"
+"                   it matches, with one thread per processor unless -j is\n"
+"                   given. In adjunct mode, driftnet exits at the end of the\n"
+"                   file.\n"
+"  -c               With -f and several files, treat files which follow on\n"
+"                   from one another in time as one capture.\n"
 "  -p               Do not put the listening interface into promiscuous mode.\n"
+"  -R               Capture packets through a memory-mapped TPACKET_V3 ring\n"
+"                   rather than libpcap (Linux only). driftnet falls back to\n"
+"                   libpcap if the ring cannot be set up.\n"
+"  -j number        Use the given number of capture threads, each reading its\n"
+"                   own share of the connections from a packet ring (implies\n"
+"                   -R) or, with -f, from the dump file.\n"
 "  -a               Adjunct mode: do not display images on screen, but save\n"
 "                   them to a temporary directory and announce their names on\n"
 "                   standard output.\n"
@@ -314,7 +481,7 @@ void usage(FILE *fp) {
 "the Free Software Foundation; either version 2 of the License, or\n"
 "(at your option) any later version.\n"
 "\n",
-            DRIFTNET_VERSION);
+            DRIFTNET_VERSION, EXTRACT_THRESHOLD, MEMORY_LIMIT / (1024 * 1024));
 }
 
 /* terminate_on_signal:
@@ -356,56 +523,130 @@ void setup_signals(void) {
     }
 }
 
-/* connection_string:
- * Return a string of the form w.x.y.z:foo -> a.b.c.d:bar for a pair of
- * addresses and ports. */
-char *connection_string(const struct in_addr s, const unsigned short s_port, const struct in_addr d, const unsigned short d_port) {
-    static char buf[50] = {0};
-    sprintf(buf, "%s:%d -> ", inet_ntoa(s), (int)s_port);
-    sprintf(buf + strlen(buf), "%s:%d", inet_ntoa(d), (int)d_port);
+/* connection_string BUF S S_PORT D D_PORT
+ * Write into BUF, which has room for CONNSTR_LEN characters, a string of the
+ * form w.x.y.z:foo -> a.b.c.d:bar for a pair of addresses and ports, and
+ * return it. Several workers may be doing this at once, so nothing here may
+ * use a static buffer, as inet_ntoa does. */
+char *connection_string(char *buf, const struct in_addr s, const unsigned short s_port, const struct in_addr d, const unsigned short d_port) {
+    char sa[INET_ADDRSTRLEN], da[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &s, sa, sizeof sa);
+    inet_ntop(AF_INET, &d, da, sizeof da);
+    snprintf(buf, CONNSTR_LEN, "%s:%d -> %s:%d", sa, (int)s_port, da, (int)d_port);
     return buf;
 }
 
-/* process_packet:
- * Callback which processes a packet captured by libpcap. */
-int pkt_offset; /* offset of IP packet within wire packet */
+/* is_http_port PORT
+ * Is PORT one on which web servers and proxies usually listen? */
+static int is_http_port(const unsigned short port) {
+    return port == 80 || port == 8000 || port == 8080 || port == 3128;
+}
 
-void process_packet(u_char *user, const struct pcap_pkthdr *hdr, const u_char *pkt) {
+/* handle_packet WORKER HEADER PACKET
+ * Process a packet captured by WORKER. */
+void handle_packet(worker w, const struct pcap_pkthdr *hdr, const u_char *pkt) {
     struct ip ip;
     struct tcphdr tcp;
     struct in_addr s, d;
     int off, len, delta;
-    connection *C, c;
+    connection c;
+    char cs[CONNSTR_LEN];
 
     if (verbose)
         fprintf(stderr, ".");
 
-    memcpy(&ip, pkt + pkt_offset, sizeof(ip));
+    ++w->npackets;
+    w->nbytes += hdr->len;
+
+    /* When reading a dump file, time is whatever the packets say it is, so
+     * that connections time out as they would have done when the packets
+     * were captured. It mustn't go backwards, though. If the file is shared
+     * with other workers, first catch up with the packets they've been given,
+     * so that our connections time out just as they would if we had seen the
+     * whole file. */
+    if (w->offline) {
+        if (w->fileclock > w->now) {
+            w->now = w->fileclock;
+            sweep_connections(w);
+        }
+        if (hdr->ts.tv_sec > w->now)
+            w->now = hdr->ts.tv_sec;
+    }
+
+    memcpy(&ip, pkt + w->pkt_offset, sizeof(ip));
     memcpy(&s, &ip.ip_src, sizeof(ip.ip_src));
     memcpy(&d, &ip.ip_dst, sizeof(ip.ip_dst));
 
-    memcpy(&tcp, pkt + pkt_offset + (ip.ip_hl << 2), sizeof(tcp));
-    off = pkt_offset + (ip.ip_hl << 2) + (tcp.th_off << 2);
+    memcpy(&tcp, pkt + w->pkt_offset + (ip.ip_hl << 2), sizeof(tcp));
+    off = w->pkt_offset + (ip.ip_hl << 2) + (tcp.th_off << 2);
     len = hdr->caplen - off;
 
     /* XXX fragmented packets and other nasties. */
     
-    /* try to find the connection slot associated with this. */
-    C = find_connection(&s, &d, ntohs(tcp.th_sport), ntohs(tcp.th_dport));
+    /* try to find the connection associated with this. */
+    c = conntable_find(w->connections, &s, &d, ntohs(tcp.th_sport), ntohs(tcp.th_dport));
+
+    if (tcp.th_flags & TH_RST) {
+        /* Looks like this connection is bogus, and so might be a
+         * connection going the other way. There's no need to start
+         * tracking one only to throw it away. */
+        if (verbose)
+            fprintf(stderr, PROGNAME": connection reset: %s\n", connection_string(cs, s, ntohs(tcp.th_sport), d, ntohs(tcp.th_dport)));
+
+        if (c) {
+            conntable_bury(w->connections, c, w->now);
+            forget_connection(w, c);
+        }
+
+        if ((c = conntable_find(w->connections, &d, &s, ntohs(tcp.th_dport), ntohs(tcp.th_sport)))) {
+            conntable_bury(w->connections, c, w->now);
+            forget_connection(w, c);
+        }
+
+        return;
+    }
+
+    /* A segment which carries no data, and isn't a SYN from which we could
+     * learn where the data will start, tells us nothing about a stream we
+     * aren't already following: bare ACKs from the receiving end of a
+     * transfer, for instance. Don't start tracking a connection for it. */
+    if (!c && len <= 0 && !(tcp.th_flags & TH_SYN)) {
+        sweep_connections(w);
+        return;
+    }
+
+    /* Nor do retransmissions which arrive after the connection has
+     * finished; but a new SYN starts a new connection. */
+    if (!c && !(tcp.th_flags & TH_SYN)
+        && conntable_buried(w->connections, &s, &d, ntohs(tcp.th_sport), ntohs(tcp.th_dport), ntohl(tcp.th_seq), w->now)) {
+        ++w->nlate;
+        sweep_connections(w);
+        return;
+    }
 
     /* no connection at all, so we need to allocate one. */
-    if (!C) {
+    if (!c) {
         if (verbose)
-            fprintf(stderr, PROGNAME": new connection: %s\n", connection_string(s, ntohs(tcp.th_sport), d, ntohs(tcp.th_dport)));
-        C = alloc_connection();
-        *C = connection_new(&s, &d, ntohs(tcp.th_sport), ntohs(tcp.th_dport));
+            fprintf(stderr, PROGNAME": new connection: %s\n", connection_string(cs, s, ntohs(tcp.th_sport), d, ntohs(tcp.th_dport)));
+        c = connection_new(w->connslab, w->pool, &s, &d, ntohs(tcp.th_sport), ntohs(tcp.th_dport), w->now);
         /* This might or might not be an entirely new connection (SYN flag
-         * set). Either way we need a sequence number to start at. */
-        (*C)->isn = ntohl(tcp.th_seq);
+         * set). Either way we need a sequence number to start at; the SYN
+         * itself takes up one, so the data start after it. */
+        c->isn = ntohl(tcp.th_seq);
+        if (tcp.th_flags & TH_SYN)
+            ++c->isn;
+        /* A server doesn't send HTTP requests. We can tell that this is the
+         * server's end of the connection if it is answering a SYN, or, if we
+         * missed the handshake, from the port. */
+        if ((tcp.th_flags & (TH_SYN | TH_ACK)) == (TH_SYN | TH_ACK)
+            || (!(tcp.th_flags & TH_SYN) && is_http_port(ntohs(tcp.th_sport))))
+            c->sigs &= ~SIG_HTTP;
+        conntable_insert(w->connections, c);
+        connqueue_push(&w->active, c);
+        ++w->nconnections;
     }
 
     /* Now we need to process this segment. */
-    c = *C;
     delta = 0;/*tcp.syn ? 1 : 0;*/
 
     /* NB (STD0007):
@@ -417,23 +658,6 @@ void process_packet(u_char *user, const struct pcap_pkthdr *hdr, const u_char *p
         c->isn = htonl(tcp.seq);
 #endif
 
-    if (tcp.th_flags & TH_RST) {
-        /* Looks like this connection is bogus, and so might be a
-         * connection going the other way. */
-        if (verbose)
-            fprintf(stderr, PROGNAME": connection reset: %s\n", connection_string(s, ntohs(tcp.th_sport), d, ntohs(tcp.th_dport)));
-        
-        connection_delete(c);
-        *C = NULL;
-
-        if ((C = find_connection(&d, &s, ntohs(tcp.th_dport), ntohs(tcp.th_sport)))) {
-            connection_delete(*C);
-            *C = NULL;
-        }
-
-        return;
-    }
-
     if (len > 0) {
         /* We have some data in the packet. If this data occurred after
          * the first data we collected for this connection, then save it
@@ -448,43 +672,384 @@ void process_packet(u_char *user, const struct pcap_pkthdr *hdr, const u_char *p
         else
             offset -= c->isn + delta;
         
-        if (offset > c->len + WRAPLEN) {
+        /* Look at the start of the stream to see whether it's worth
+         * keeping. */
+        if (offset == 0 && c->nblocks == 0 && c->discarded == 0 && !c->ignored) {
+            switch (classify_stream(pkt + off, len)) {
+                case st_tls:
+                case st_ssh:
+                    c->sigs = 0;
+                    break;
+
+                case st_request:
+                    c->sigs &= SIG_HTTP;
+                    break;
+
+                case st_response:
+                    c->sigs &= ~SIG_HTTP;
+                    /* We can follow the responses and look only at their
+                     * bodies, unless we are after audio, which may be
+                     * streamed as one endless body. */
+                    if (!(media_sigs(extract_type) & SIG_MPEG))
+                        httpresp_new(c);
+                    break;
+
+                default:
+                    break;
+            }
+            if (!(c->sigs & media_sigs(extract_type))) {
+                if (verbose)
+                    fprintf(stderr, PROGNAME": ignoring connection: %s\n", connection_string(cs, s, ntohs(tcp.th_sport), d, ntohs(tcp.th_dport)));
+                c->ignored = 1;
+                ++w->nignored;
+            }
+        }
+
+        if (c->ignored) {
+            /* Nothing to keep, but the connection is still alive. */
+            w->nignoredbytes += len;
+            c->last = w->now;
+            if (c->queue[QUEUE_EXPIRY] == &w->active)
+                connqueue_push(&w->active, c);
+        } else if (offset > c->len + WRAPLEN) {
             /* Out-of-order packet. */
             if (verbose) 
-                fprintf(stderr, PROGNAME": out of order packet: %s\n", connection_string(s, ntohs(tcp.th_sport), d, ntohs(tcp.th_dport)));
+                fprintf(stderr, PROGNAME": out of order packet: %s\n", connection_string(cs, s, ntohs(tcp.th_sport), d, ntohs(tcp.th_dport)));
         } else {
-            connection_push(c, pkt + off, offset, len);
-            connection_extract_media(c, extract_type);
+            unsigned int fresh;
+            if (timing) {
+                double t = timing_now();
+                fresh = connection_push(c, pkt + off, offset, len, w->now);
+                w->t_push += timing_now() - t;
+            } else
+                fresh = connection_push(c, pkt + off, offset, len, w->now);
+            if (c->nblocks)
+                connqueue_push(&w->holding, c);
+            /* Keep count of data we already had, which a lossy link will
+             * send us a lot of. */
+            if (fresh == 0) {
+                ++w->ndupsegs;
+                w->ndupbytes += len;
+            } else
+                w->noverlapbytes += len - fresh;
+            c->pending += fresh;
+            /* Re-arm the idle timeout. */
+            if (c->queue[QUEUE_EXPIRY] == &w->active)
+                connqueue_push(&w->active, c);
         }
     }
+
+    /* Search the connection for media now if enough has arrived since last
+     * time, or the sender has said that this is the end of something;
+     * otherwise, put it off. */
+    if (c->pending > 0) {
+        if (c->pending >= extract_threshold || (tcp.th_flags & (TH_PUSH | TH_FIN)))
+            extract_media(w, c);
+        else
+            connqueue_push(&w->pending, c);
+    }
+
     if (tcp.th_flags & TH_FIN) {
         /* Connection closing; mark it as closed, but let sweep_connections
          * free it if appropriate. */
         if (verbose)
-            fprintf(stderr, PROGNAME": connection closing: %s, %d bytes transferred\n", connection_string(s, ntohs(tcp.th_sport), d, ntohs(tcp.th_dport)), c->len);
+            fprintf(stderr, PROGNAME": connection closing: %s, %lu bytes transferred\n", connection_string(cs, s, ntohs(tcp.th_sport), d, ntohs(tcp.th_dport)), c->discarded + c->len);
         c->fin = 1;
     }
 
+    if (c->len > MAXCONNECTIONDATA) {
+        extract_media(w, c);
+        if (c->len > MAXCONNECTIONDATA) {
+            if (verbose)
+                fprintf(stderr, PROGNAME": discarding unsearched data: %s\n", connection_string(cs, s, ntohs(tcp.th_sport), d, ntohs(tcp.th_dport)));
+            connection_discard(c, c->len - MAXCONNECTIONDATA / 2);
+        }
+    }
+
+    evict_connections(w, c);
+
+    if (c->queue[QUEUE_EXPIRY] != &w->closing && c->fin && c->nblocks <= 1)
+        connqueue_push(&w->closing, c);
+
     /* sweep out old connections */
-    sweep_connections();
+    sweep_connections(w);
+    report_memory(w);
+}
+
+/* process_packet:
+ * Callback which processes a packet captured by libpcap or one of our own
+ * packet sources. USER is the worker which captured it. With -T, the time
+ * spent here other than in reassembly and extraction is counted as
+ * connection tracking. */
+void process_packet(u_char *user, const struct pcap_pkthdr *hdr, const u_char *pkt) {
+    worker w = (worker)user;
+    if (timing) {
+        double t = timing_now(), p = w->t_push, x = w->t_extract;
+        handle_packet(w, hdr, pkt);
+        w->t_track += timing_now() - t - (w->t_push - p) - (w->t_extract - x);
+    } else
+        handle_packet(w, hdr, pkt);
+}
+
+/* Number of packets we take from a dump file at a time. */
+#define FILE_BATCH  4096
+
+/* open_dump_file WORKER NAME
+ * Open the dump file NAME for WORKER to read, ourselves if we can or
+ * otherwise with libpcap. Returns the link type of the file, or -1 on
+ * failure. */
+int open_dump_file(worker w, const char *name) {
+    char ebuf[PCAP_ERRBUF_SIZE];
+    int fallback;
+
+    w->offline = 1;
+    if ((w->file = pcapfile_open(name, &fallback)))
+        return pcapfile_datalink(w->file);
+    else if (!fallback)
+        return -1;
+    else if ((w->pc = pcap_open_offline(name, ebuf)))
+        return pcap_datalink(w->pc);
+    else {
+        fprintf(stderr, PROGNAME": pcap_open_offline: %s\n", ebuf);
+        return -1;
+    }
+}
+
+/* close_dump_file WORKER
+ * Close the dump file WORKER has been reading. */
+void close_dump_file(worker w) {
+    if (w->file)
+        pcapfile_close(w->file);
+    else if (w->pc)
+        pcap_close(w->pc);
+    w->file = NULL;
+    w->pc = NULL;
+}
+
+/* dispatch_dump_file WORKER
+ * Pass the next batch of packets from WORKER's dump file to process_packet.
+ * Returns the number of packets processed, which is 0 at the end of the file
+ * or on error. */
+int dispatch_dump_file(worker w) {
+    int n;
+    if (w->file && w->sharefile)
+        n = pcapfile_dispatch_share(w->file, w->id, FILE_BATCH, process_packet, (u_char*)w, &w->fileclock);
+    else if (w->file)
+        n = pcapfile_dispatch(w->file, FILE_BATCH, process_packet, (u_char*)w);
+    else if ((n = pcap_dispatch(w->pc, FILE_BATCH, process_packet, (u_char*)w)) < 0) {
+        fprintf(stderr, PROGNAME": pcap_dispatch: %s\n", pcap_geterr(w->pc));
+        n = 0;
+    }
+    return n;
 }
 
 /* packet_capture_thread:
- * Thread in which packet capture runs. */
+ * Thread in which packet capture runs. The parameter is the worker whose
+ * packet source we read. */
 void *packet_capture_thread(void *v) {
-    while (!foad)
-        pcap_dispatch(pc, -1, process_packet, NULL);
+    worker w = (worker)v;
+    while (!foad) {
+        /* When capturing live, we read the clock once for each batch of
+         * packets rather than once per packet. */
+        if (!w->offline)
+            w->now = time(NULL);
+
+        if (w->ring)
+            packetring_dispatch(w->ring, 1000, process_packet, (u_char*)w);
+        else if (w->offline) {
+            /* Take the file a batch at a time so that we notice if we're
+             * told to stop. At the end, anything left over won't get any
+             * more data. */
+            if (dispatch_dump_file(w) == 0) {
+                flush_connections(w);
+                gettimeofday(&w->finish, NULL);
+                w->finished = 1;
+                break;
+            }
+        } else {
+            if (w->pcap_fd != -1) {
+                struct pollfd pfd;
+                pfd.fd = w->pcap_fd;
+                pfd.events = POLLIN;
+                pfd.revents = 0;
+                poll(&pfd, 1, 1000);
+            }
+            pcap_dispatch(w->pc, -1, process_packet, (u_char*)w);
+        }
+        /* Flush out connections which have gone idle, even if no packets
+         * have arrived to prompt us. */
+        sweep_connections(w);
+        report_memory(w);
+    }
     return NULL;
 }
 
+/* capture_finished:
+ * Have all the workers come to the end of their input? */
+int capture_finished(void) {
+    int i;
+    for (i = 0; i < nworkers; ++i)
+        if (!workers[i]->finished)
+            return 0;
+    return 1;
+}
+
+/* drop_workers N
+ * Free the workers after the first N, which can't be used, and reduce
+ * nworkers to match. */
+void drop_workers(const int n) {
+    while (nworkers > n)
+        worker_delete(workers[--nworkers]);
+}
+
+/* open_capture_rings INTERFACE PROMISC FILTEREXPR LINKTYPE
+ * Open a TPACKET_V3 ring for each worker. If there is more than one worker,
+ * the rings are joined into a PACKET_FANOUT group which hashes on the flow,
+ * so that both halves of any connection are always seen by the same worker.
+ * Reduces nworkers if not all the rings can be set up. Returns nonzero if at
+ * least one ring was opened. */
+int open_capture_rings(const char *interface, const int promisc, const char *filterexpr, int *linktype) {
+    int i, group;
+
+    group = getpid() & 0xffff;
+    for (i = 0; i < nworkers; ++i) {
+        if (!(workers[i]->ring = packetring_open(interface, promisc, filterexpr, linktype)))
+            break;
+        /* Until the socket joins the group it sees every packet, so a few
+         * flows may be tracked by two workers at start-up; that's harmless. */
+        if (nworkers > 1 && packetring_join_fanout(workers[i]->ring, group) == -1) {
+            packetring_close(workers[i]->ring);
+            workers[i]->ring = NULL;
+            break;
+        }
+    }
+
+    if (i < nworkers) {
+        if (i > 0)
+            fprintf(stderr, PROGNAME": warning: only %d of %d capture threads could be started\n", i, nworkers);
+        drop_workers(i ? i : 1);
+    }
+
+    return i > 0;
+}
+
+/* elapsed_since START END
+ * Return the number of seconds between START and END, or between START and
+ * now if END is zero. */
+double elapsed_since(const struct timeval *start, const struct timeval *end) {
+    struct timeval now;
+    if (!end->tv_sec) {
+        gettimeofday(&now, NULL);
+        end = &now;
+    }
+    return (end->tv_sec - start->tv_sec) + (end->tv_usec - start->tv_usec) / 1e6;
+}
+
+/* print_capture_stats:
+ * Report how many packets each worker has processed, and how many packets the
+ * kernel captured and dropped on our behalf. For a dump file, also report how
+ * long it took and how fast each worker went. */
+void print_capture_stats(void) {
+    unsigned long npackets = 0, nbytes = 0, nconnections = 0, nfiles = 0;
+    unsigned long ndupsegs = 0, ndupbytes = 0, noverlapbytes = 0;
+    unsigned long nevicted = 0, nevictedbytes = 0, nignored = 0, nignoredbytes = 0, nlate = 0;
+    unsigned int received = 0, dropped = 0;
+    int i, have_kstats = 1;
+    double wall = 0;
+
+    for (i = 0; i < nworkers; ++i) {
+        worker w = workers[i];
+        unsigned int r, d;
+        double t;
+
+        t = elapsed_since(&capture_start, &w->finish);
+        if (t > wall)
+            wall = t;
+        if (nworkers > 1 && w->offline)
+            fprintf(stderr, PROGNAME": worker %d: %lu packets, %lu bytes, %lu connections in %.2fs (%.0f packets/s, %.1f Mbytes/s)\n",
+                    w->id, w->npackets, w->nbytes, w->nconnections, t, t > 0 ? w->npackets / t : 0., t > 0 ? w->nbytes / t / 1048576. : 0.);
+        else if (nworkers > 1)
+            fprintf(stderr, PROGNAME": worker %d: %lu packets, %lu bytes, %lu connections\n", w->id, w->npackets, w->nbytes, w->nconnections);
+        npackets += w->npackets;
+        nbytes += w->nbytes;
+        nconnections += w->nconnections;
+        nfiles += w->nfiles;
+        ndupsegs += w->ndupsegs;
+        ndupbytes += w->ndupbytes;
+        noverlapbytes += w->noverlapbytes;
+        nevicted += w->nevicted;
+        nevictedbytes += w->nevictedbytes;
+        nignored += w->nignored;
+        nignoredbytes += w->nignoredbytes;
+        nlate += w->nlate;
+
+        if (w->ring) {
+            if (packetring_stats(w->ring, &r, &d) == -1)
+                have_kstats = 0;
+        } else if (w->pc) {
+            struct pcap_stat ps;
+            if (pcap_stats(w->pc, &ps) == -1)
+                have_kstats = 0;
+            r = ps.ps_recv;
+            d = ps.ps_drop;
+        } else
+            have_kstats = 0;
+        if (have_kstats) {
+            received += r;
+            dropped += d;
+        }
+    }
+
+    fprintf(stderr, PROGNAME": %lu packets, %lu bytes, %lu connections processed\n", npackets, nbytes, nconnections);
+    if (nfiles)
+        fprintf(stderr, PROGNAME": %lu dump files read\n", nfiles);
+    if (ndupsegs || noverlapbytes)
+        fprintf(stderr, PROGNAME": %lu duplicate segments (%lu bytes) dropped, %lu overlapping bytes trimmed\n", ndupsegs, ndupbytes, noverlapbytes);
+    if (nignored)
+        fprintf(stderr, PROGNAME": %lu connections ignored as encrypted or carrying nothing to extract (%lu bytes)\n", nignored, nignoredbytes);
+    if (nlate)
+        fprintf(stderr, PROGNAME": %lu late segments for finished connections dropped\n", nlate);
+    if (nevicted)
+        fprintf(stderr, PROGNAME": %lu connections dropped to stay within the memory limit, freeing %lu Kbytes\n", nevicted, nevictedbytes / 1024);
+    if (workers[0]->offline)
+        fprintf(stderr, PROGNAME": wall time %.2fs (%.0f packets/s, %.1f Mbytes/s)\n", wall, wall > 0 ? npackets / wall : 0., wall > 0 ? nbytes / wall / 1048576. : 0.);
+    if (have_kstats)
+        fprintf(stderr, PROGNAME": %u packets received, %u dropped by kernel\n", received, dropped);
+
+    if (timing) {
+        double track = 0, push = 0, extract = 0, busy = 0;
+        struct allocstats objs = {0}, bufs = {0};
+        struct rusage ru;
+
+        for (i = 0; i < nworkers; ++i) {
+            track += workers[i]->t_track;
+            push += workers[i]->t_push;
+            extract += workers[i]->t_extract;
+            busy += elapsed_since(&capture_start, &workers[i]->finish);
+            slab_stats(workers[i]->connslab, &objs);
+            bufpool_stats(workers[i]->pool, &bufs);
+        }
+        mpeg_alloc_stats(&objs, &bufs);
+        fprintf(stderr, PROGNAME": %lu media objects extracted (%.1f/s)\n", media_count, wall > 0 ? media_count / wall : 0.);
+        fprintf(stderr, PROGNAME": seconds in connection tracking %.3f, reassembly %.3f, media extraction %.3f, reading packets %.3f\n",
+                track, push, extract, busy - track - push - extract);
+        fprintf(stderr, PROGNAME": %lu objects allocated from slabs (%lu reused), at most %lu in use, %lu Kbytes of slabs\n",
+                objs.nalloc, objs.nreused, objs.maxlive, (unsigned long)(objs.maxbytes / 1024));
+        fprintf(stderr, PROGNAME": %lu buffers allocated from pools (%lu reused), at most %lu Kbytes in use and %lu Kbytes held, %lu in huge pages\n",
+                bufs.nalloc, bufs.nreused, (unsigned long)(bufs.maxinuse / 1024), (unsigned long)(bufs.maxbytes / 1024), bufs.nhuge);
+        if (getrusage(RUSAGE_SELF, &ru) == 0)
+            fprintf(stderr, PROGNAME": peak resident set size %ld Kbytes\n", (long)ru.ru_maxrss);
+    }
+}
+
 /* main:
  * Entry point. Process command line options, start up pcap and enter capture
  * loop. */
-char optstring[] = "abd:f:hi:M:m:pSsvx:";
+char optstring[] = "aB:bcd:f:hi:j:L:M:m:pRSsTvx:";
 
 int main(int argc, char *argv[]) {
-    char *interface = NULL, *filterexpr;
-    int promisc = 1;
+    char *interface = NULL, *filterexpr = NULL;
+    int promisc = 1, use_ring = 0, linktype, i;
     struct bpf_program filter;
     char ebuf[PCAP_ERRBUF_SIZE];
     int c;
@@ -495,9 +1060,8 @@ int main(int argc, char *argv[]) {
     int newpfx = 0;
     int mpeg_player_specified = 0;
     char *dumpfile = NULL;
-    
-    pthread_t packetth;
-    connection *C;
+    int nworkers_specified = 0, merge_files = 0, batch = 0;
+
 
     /* Handle command-line options. */
     opterr = 0;
@@ -530,6 +1094,49 @@ int main(int argc, char *argv[]) {
                 promisc = 0;
                 break;
 
+            case 'R':
+                use_ring = 1;
+                break;
+
+            case 'j':
+                nworkers = atoi(optarg);
+                if (nworkers <= 0) {
+                    fprintf(stderr, PROGNAME": `%s' does not make sense for -j\n", optarg);
+                    return -1;
+                }
+                nworkers_specified = 1;
+                break;
+
+            case 'c':
+                merge_files = 1;
+                break;
+
+            case 'T':
+                timing = 1;
+                break;
+
+            case 'L': {
+                char *q;
+                long l = strtol(optarg, &q, 10);
+                if (*q || q == optarg || l <= 0) {
+                    fprintf(stderr, PROGNAME": `%s' does not make sense for -L\n", optarg);
+                    return -1;
+                }
+                memory_limit = (size_t)l;
+                break;
+            }
+
+            case 'B': {
+                char *q;
+                long l = strtol(optarg, &q, 10);
+                if (*q || q == optarg || l < 0) {
+                    fprintf(stderr, PROGNAME": `%s' does not make sense for -B\n", optarg);
+                    return -1;
+                }
+                extract_threshold = (unsigned int)l;
+                break;
+            }
+
             case 's':
                 extract_type |= m_audio;
                 break;
@@ -612,6 +1219,29 @@ int main(int argc, char *argv[]) {
     if (max_tmpfiles && adjunct && verbose)
         fprintf(stderr, PROGNAME": a maximum of %d images will be buffered\n", max_tmpfiles);
 
+    /* -j shares out a dump file, or implies -R for a live capture. */
+    if (use_ring && dumpfile) {
+        fprintf(stderr, PROGNAME": warning: -R ignored with -f\n");
+        use_ring = 0;
+    } else if (nworkers > 1)
+        use_ring = 1;
+
+    /* If -f names a directory or a wildcard, read all the files with a pool
+     * of threads, by default one per processor. */
+    if (dumpfile) {
+        long ncpus;
+        if (!nworkers_specified && (ncpus = sysconf(_SC_NPROCESSORS_ONLN)) > 1)
+            i = (int)ncpus;
+        else
+            i = nworkers;
+        if ((batch = batch_open(dumpfile, i, merge_files ? TIMEOUT : -1)) == -1)
+            return -1;
+        else if (batch)
+            nworkers = i;
+    }
+    if (merge_files && !batch)
+        fprintf(stderr, PROGNAME": warning: -c only makes sense when -f names several files\n");
+
     if (beep && adjunct)
         fprintf(stderr, PROGNAME": can't beep in adjunct mode\n");
 
@@ -683,7 +1313,7 @@ int main(int argc, char *argv[]) {
         }
     } else filterexpr = "tcp";
 
-    if (verbose)
+    if (verbose && filterexpr)
         fprintf(stderr, PROGNAME": using filter expression `%s'\n", filterexpr);
     
 
@@ -726,14 +1356,31 @@ int main(int argc, char *argv[]) {
         fprintf(stderr, PROGNAME": operating in adjunct mode\n");
 #endif /* !NO_DISPLAY_WINDOW */
  
+    workers = xcalloc(nworkers, sizeof *workers);
+    for (i = 0; i < nworkers; ++i)
+        workers[i] = worker_new(i);
+
     /* Start up pcap. */
-    if (dumpfile) {
-        if (!(pc = pcap_open_offline(dumpfile, ebuf))) {
-            fprintf(stderr, PROGNAME": pcap_open_offline: %s\n", ebuf);
+    if (dumpfile && batch) {
+        /* Each worker opens the files it is given as it goes along. */
+        for (i = 0; i < nworkers; ++i)
+            workers[i]->offline = 1;
+    } else if (dumpfile) {
+        if ((linktype = open_dump_file(workers[0], dumpfile)) == -1)
             return -1;
-        }   
+    } else if (use_ring && open_capture_rings(interface, promisc, filterexpr, &linktype)) {
+        /* Capturing from packet rings; the filter is already attached. */
     } else {
-        if (!(pc = pcap_open_live(interface, SNAPLEN, promisc, 1000, ebuf))) {
+        pcap_t *pc;
+
+        if (use_ring)
+            fprintf(stderr, PROGNAME": falling back to libpcap\n");
+        if (nworkers > 1) {
+            fprintf(stderr, PROGNAME": warning: only one capture thread can be used with libpcap\n");
+            drop_workers(1);
+        }
+
+        if (!(pc = workers[0]->pc = pcap_open_live(interface, SNAPLEN, promisc, 1000, ebuf))) {
             fprintf(stderr, PROGNAME": pcap_open_live: %s\n", ebuf);
 
             if (getuid() != 0)
@@ -754,27 +1401,62 @@ int main(int argc, char *argv[]) {
             fprintf(stderr, PROGNAME": pcap_setfilter: %s\n", pcap_geterr(pc));
             return -1;
         }
+
+        /* If we can, wait for packets with poll(2), so that we notice idle
+         * connections when nothing is arriving. */
+        if (pcap_setnonblock(pc, 1, ebuf) == 0)
+            workers[0]->pcap_fd = pcap_get_selectable_fd(pc);
+
+        linktype = pcap_datalink(pc);
     }
 
     /* Figure out the offset from the start of a returned packet to the data in
      * it. */
-    pkt_offset = get_link_level_hdr_length(pcap_datalink(pc));
-    if (verbose)
-        fprintf(stderr, PROGNAME": link-level header length is %d bytes\n", pkt_offset);
+    if (!batch) {
+        for (i = 0; i < nworkers; ++i)
+            workers[i]->pkt_offset = get_link_level_hdr_length(linktype);
+        if (verbose)
+            fprintf(stderr, PROGNAME": link-level header length is %d bytes\n", workers[0]->pkt_offset);
+    }
 
-    slotsused = 0;
-    slotsalloc = 64;
-    slots = (connection*)xcalloc(slotsalloc, sizeof(connection));
+    /* If there are several workers reading one dump file, share it out among
+     * them. We can only do this for files we've mapped ourselves. */
+    if (dumpfile && !batch && nworkers > 1) {
+        if (workers[0]->file && pcapfile_split(workers[0]->file, nworkers, workers[0]->pkt_offset) == 0) {
+            for (i = 0; i < nworkers; ++i) {
+                workers[i]->file = workers[0]->file;
+                workers[i]->offline = 1;
+                workers[i]->sharefile = 1;
+            }
+        } else {
+            fprintf(stderr, PROGNAME": warning: only one thread can be used with this dump file\n");
+            drop_workers(1);
+        }
+    }
 
     /* Actually start the capture stuff up. Unfortunately, on many platforms,
      * libpcap doesn't have read timeouts, so we start the thing up in a
      * separate thread. Yay! */
-    pthread_create(&packetth, NULL, packet_capture_thread, NULL);
+    for (i = 0; i < nworkers; ++i)
+        workers[i]->memory_limit = memory_limit / nworkers;
+    if (memory_limit / nworkers < MIN_MEMORY_LIMIT) {
+        fprintf(stderr, PROGNAME": warning: raising memory limit to %lu bytes\n", (unsigned long)MIN_MEMORY_LIMIT * nworkers);
+        for (i = 0; i < nworkers; ++i)
+            workers[i]->memory_limit = MIN_MEMORY_LIMIT;
+    }
 
-    while (!foad)
+    gettimeofday(&capture_start, NULL);
+    for (i = 0; i < nworkers; ++i)
+        pthread_create(&workers[i]->thread, NULL, batch ? batch_thread : packet_capture_thread, workers[i]);
+    if (verbose && nworkers > 1)
+        fprintf(stderr, PROGNAME": started %d capture threads\n", nworkers);
+
+    /* In adjunct mode, we're finished once we reach the end of a dump file;
+     * otherwise we leave the images on display until we're told to stop. */
+    while (!foad && !(adjunct && capture_finished()))
         sleep(1);
 
-    if (verbose) {
+    if (verbose && foad) {
         if (foad == SIGCHLD) {
             pid_t pp;
             int st;
@@ -791,18 +1473,22 @@ int main(int argc, char *argv[]) {
             fprintf(stderr, PROGNAME": caught signal %d\n", foad);
     }
     
-    pthread_cancel(packetth); /* make sure thread quits even if it's stuck in pcap_dispatch */
-    pthread_join(packetth, NULL);
+    for (i = 0; i < nworkers; ++i)
+        pthread_cancel(workers[i]->thread); /* make sure thread quits even if it's stuck in pcap_dispatch */
+    for (i = 0; i < nworkers; ++i)
+        pthread_join(workers[i]->thread, NULL);
+
+    if (verbose || timing || (dumpfile && (batch || nworkers > 1)))
+        print_capture_stats();
     
     /* Clean up. */
 /*    pcap_freecode(pc, &filter);*/ /* not on some systems... */
-    pcap_close(pc);
     clean_temporary_directory();
 
     /* Easier for memory-leak debugging if we deallocate all this here.... */
-    for (C = slots; C < slots + slotsalloc; ++C)
-        if (*C) connection_delete(*C);
-    xfree(slots);
+    for (i = 0; i < nworkers; ++i)
+        worker_delete(workers[i]);
+    xfree(workers);
  //   if (!tmpdir_specified)
  //	xfree(tmpdir);
 
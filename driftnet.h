@@ -20,6 +20,7 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <sys/time.h>
+#include <pthread.h>
 #include <stdio.h>
 #ifndef USE_SYS_TYPES_H
 #   include <stdint.h>
@@ -30,59 +31,318 @@
  * = {0}). */
 #define alloc_struct(S, p) do { struct S as__z = {0}; p = xmalloc(sizeof *p); *p = as__z; } while (0)
 
+/* slab, bufpool:
+ * Allocators for objects of one size, and for buffers of sizes which are
+ * powers of two, which keep what they are given back for reuse. See pool.c. */
+typedef struct _slab *slab;
+typedef struct _bufpool *bufpool;
+
+/* struct allocstats:
+ * What a slab or bufpool has done: objects handed out, and how many of them
+ * were reused; how many are in use now and the most there have been; bytes
+ * in use now and at most; bytes got from the system now and at most; and
+ * buffers in huge pages. */
+struct allocstats {
+    unsigned long nalloc, nreused, nlive, maxlive;
+    size_t inuse, maxinuse, bytes, maxbytes;
+    unsigned long nhuge;
+};
+
 /* enum mediatype:
  * Bit field to characterise types of media which we can extract. */
 enum mediatype { m_image = 1, m_audio = 2, m_text = 4 };
 
 #define NMEDIATYPES     5       /* keep up to date with media.c */
+#define SIG_ALL         ((1 << NMEDIATYPES) - 1)
+
+/* struct mediastate:
+ * How far a media parser has got with an object whose end it hasn't seen
+ * yet, so that when more data arrive it can carry on from there rather than
+ * starting again. */
+struct mediastate {
+    int start;      /* offset in the block of the object */
+    int pos;        /* offset in the object to carry on from; 0 to start afresh */
+    int phase;      /* what the parser was doing there */
+    int count;      /* anything else the parser needs to remember */
+};
 
 /* struct datablock:
- * Represents an extent in a captured stream. */
+ * Represents an extent in a captured stream, and holds its data. */
 struct datablock {
     int off, len, moff[NMEDIATYPES], dirty;
-    struct datablock *next;
+    unsigned char *data;
+    int alloc;
+    struct mediastate mstate[NMEDIATYPES];
 };
 
+struct connqueue;
+
+/* A connection can be on three queues at once: one which orders connections
+ * for expiry, one of those which have data not yet searched for media, and
+ * one of those which hold buffers, from which they are evicted when memory
+ * runs short. */
+#define QUEUE_EXPIRY    0
+#define QUEUE_PENDING   1
+#define QUEUE_DATA      2
+#define NQUEUES         3
+
 /* connection:
  * Object representing one half of a TCP stream connection. Each connection
- * maintains a record of the data which has been recovered from the network
- * and a list of blocks of data which represent valid data in the buffer, so
- * that if there is a gap in the received data, we don't search it for
- * data. */
+ * keeps the data which have been recovered from the network as blocks, each
+ * holding a contiguous extent of the stream, so that if there is a gap in the
+ * received data, we don't search it for data. */
 typedef struct _connection {
     /* Source/destination address/port of this half-duplex connection. */
     struct in_addr src, dst;
     short int sport, dport;
     /* The TCP initial-sequence-number of the connection. */
     uint32_t isn;
-    /* The highest offset and the buffer size allocated, and the buffer
-     * itself. */
-    unsigned int len, alloc;
-    unsigned char *data;
+    /* The highest offset of any data received. Offsets are from the first
+     * byte we still have; data before it have been discarded (see
+     * connection_discard), and isn advanced to match. */
+    unsigned int len;
+    /* The number of bytes discarded from the start of the stream. */
+    unsigned long discarded;
     /* Flag indicating that we've seen a FIN-flagged segment for this stream,
      * so that it is undergoing a shutdown. */
     int fin;
     /* The time at which we last received any data on this stream. */
     time_t last;
-    /* A list of the extents in the buffer which contain valid data. */
+    /* The number of bytes received since we last searched for media. */
+    unsigned int pending;
+    /* The media drivers which are worth running on this stream, as a mask of
+     * SIG_ bits, judging by which end of the connection it comes from and
+     * how it starts; and nonzero if the stream can't contain media which we
+     * want, because it is encrypted or none of those drivers is wanted, so
+     * that its data are thrown away as they arrive. */
+    int sigs, ignored;
+    /* The extents of the stream which we have, in order of offset, none
+     * overlapping or adjoining another; the number of them and the number
+     * there is room for. */
     struct datablock *blocks;
+    int nblocks, nblocksalloc;
+    /* If the stream is one of HTTP responses, where we have got to in
+     * following them, or NULL; see httpresp.c. */
+    struct httpresp *http;
+    /* The queues of connections which this one is on, and its neighbours
+     * there, indexed by QUEUE_EXPIRY, QUEUE_PENDING or QUEUE_DATA. */
+    struct connqueue *queue[NQUEUES];
+    struct _connection *qprev[NQUEUES], *qnext[NQUEUES];
+    /* Where this structure came from, and where its buffers come from. */
+    slab connslab;
+    bufpool pool;
 } *connection;
 
+/* struct connqueue:
+ * A doubly-linked list of connections, used to order them for expiry or for
+ * searching. WHICH says which of a connection's links the queue uses. */
+struct connqueue {
+    connection head, tail;
+    int which;
+};
+
+/* conntable:
+ * A hash table of connections, indexed by addresses and ports. */
+typedef struct _conntable *conntable;
+
+/* worker:
+ * Object representing one packet capture thread. Each worker reads packets
+ * from its own source and keeps its own table of connections, so that workers
+ * share no state except in the code which dispatches media. */
+typedef struct _worker {
+    int id;
+    pthread_t thread;
+    /* Where packets come from: a libpcap handle, a TPACKET_V3 ring or a dump
+     * file we read ourselves. */
+    struct pcap *pc;
+    struct packetring *ring;
+    struct pcapfile *file;
+    /* Offset of the IP header within the captured frames. */
+    int pkt_offset;
+    /* Nonzero if file is shared with the other workers. */
+    int sharefile;
+    /* If not -1, a descriptor we can poll(2) for packets from pc. */
+    int pcap_fd;
+    /* Nonzero if we are reading a dump file rather than a live capture, and set once
+     * we have reached the end of it. */
+    int offline;
+    volatile int finished;
+    /* The time as far as this worker is concerned: the timestamp of the
+     * latest packet from a dump file, or the wall clock, read once per batch
+     * of packets, for a live capture. */
+    time_t now;
+    /* When several workers share a dump file, the latest timestamp of the
+     * packets before the current one, including those which went to other
+     * workers. */
+    time_t fileclock;
+    /* The connections this worker is tracking; those which are still open,
+     * least recently active first; those which are finished with; those
+     * with data which we have put off searching, least recently active
+     * first; and those which hold buffers, least recently given data first. */
+    conntable connections;
+    struct connqueue active, closing, pending, holding;
+    /* Allocators for the worker's connections and their buffers, and its
+     * share of the limit on the memory those buffers use (see -L). */
+    slab connslab;
+    bufpool pool;
+    size_t memory_limit;
+    /* When, by the worker's clock, we last reported how much of that memory
+     * was in use (see report_memory). */
+    time_t lastreport;
+    /* Statistics. These are only written by the worker's own thread, and are
+     * summed once the threads have stopped. */
+    unsigned long npackets, nbytes, nconnections, nfiles;
+    /* Segments, and bytes of data, which we already had all of, and bytes
+     * in segments we had some of. */
+    unsigned long ndupsegs, ndupbytes, noverlapbytes;
+    /* Connections dropped to stay within the memory limit, and the bytes
+     * which that freed. */
+    unsigned long nevicted, nevictedbytes;
+    /* Connections ignored because they are encrypted or can't carry any
+     * media we want, and the bytes of data sent on them which we threw
+     * away. */
+    unsigned long nignored, nignoredbytes;
+    /* Segments which arrived late for connections which had finished. */
+    unsigned long nlate;
+    struct timeval finish;
+    /* With -T, seconds spent tracking connections, reassembling them and
+     * extracting media from them. */
+    double t_track, t_push, t_extract;
+} *worker;
+
 /* driftnet.c */
-char *connection_string(const struct in_addr s, const unsigned short s_port, const struct in_addr d, const unsigned short d_port);
+#define CONNSTR_LEN     48      /* "255.255.255.255:65535 -> 255.255.255.255:65535" */
+char *connection_string(char *buf, const struct in_addr s, const unsigned short s_port, const struct in_addr d, const unsigned short d_port);
 void dump_data(FILE *fp, const unsigned char *data, const unsigned int len);
+worker worker_new(const int id);
+void worker_delete(worker w);
+double timing_now(void);
+void extract_media(worker w, connection c);
+void finish_media(worker w, connection c);
+void sweep_connections(worker w);
+void report_memory(worker w);
+void flush_connections(worker w);
+int open_dump_file(worker w, const char *name);
+void close_dump_file(worker w);
+int dispatch_dump_file(worker w);
+int get_link_level_hdr_length(int type);
+
+/* batch.c */
+int batch_open(const char *spec, const int nthreads, const int maxgap);
+void *batch_thread(void *v);
 
 /* connection.c */
-connection connection_new(const struct in_addr *src, const struct in_addr *dst, const short int sport, const short int dport);
+connection connection_new(slab S, bufpool P, const struct in_addr *src, const struct in_addr *dst, const short int sport, const short int dport, const time_t now);
 void connection_delete(connection c);
-void connection_push(connection c, const unsigned char *data, unsigned int off, unsigned int len);
-connection *alloc_connection(void);
-connection *find_connection(const struct in_addr *src, const struct in_addr *dst, const short int sport, const short int dport);
+unsigned int connection_push(connection c, const unsigned char *data, unsigned int off, unsigned int len, const time_t now);
+void connection_discard(connection c, unsigned int upto);
+unsigned char *connection_data(connection c, const unsigned int off, unsigned int *len);
+void connqueue_push(struct connqueue *Q, connection c);
+void connqueue_remove(const int which, connection c);
+
+/* conntable.c */
+conntable conntable_new(void);
+void conntable_delete(conntable T);
+connection conntable_find(conntable T, const struct in_addr *src, const struct in_addr *dst, const short int sport, const short int dport);
+void conntable_insert(conntable T, connection c);
+void conntable_remove(conntable T, connection c);
+connection conntable_next(conntable T, unsigned int *pos);
+void conntable_bury(conntable T, connection c, const time_t now);
+void conntable_forget_graves(conntable T);
+int conntable_buried(conntable T, const struct in_addr *src, const struct in_addr *dst, const short int sport, const short int dport, const uint32_t seq, const time_t now);
+
+/* httpresp.c */
+struct httpresp;
+void httpresp_new(connection c);
+void httpresp_delete(connection c);
+void httpresp_abandon(connection c);
+void httpresp_discard(connection c, const unsigned int upto);
+unsigned int httpresp_keep(const connection c);
+int httpresp_frame(connection c, const int sigs, void (*found)(const int i, const unsigned char *media, const size_t mlen, void *arg), void *arg);
 
 /* media.c */
+int media_sigs(const enum mediatype T);
 void connection_extract_media(connection c, const enum mediatype T);
+extern unsigned long media_count;
 int is_driftnet_file(char *filename);
 
+/* packetring.c */
+struct pcap_pkthdr;
+struct packetring;
+struct packetring *packetring_open(const char *interface, const int promisc, const char *filterexpr, int *dlt);
+int packetring_dispatch(struct packetring *R, const int timeout, void (*callback)(u_char *, const struct pcap_pkthdr *, const u_char *), u_char *user);
+int packetring_join_fanout(struct packetring *R, const int group);
+int packetring_stats(struct packetring *R, unsigned int *received, unsigned int *dropped);
+void packetring_close(struct packetring *R);
+
+/* pcapfile.c */
+struct pcapfile;
+struct pcapfile *pcapfile_open(const char *name, int *fallback);
+int pcapfile_datalink(struct pcapfile *F);
+int pcapfile_dispatch(struct pcapfile *F, const int cnt, void (*callback)(u_char *, const struct pcap_pkthdr *, const u_char *), u_char *user);
+int pcapfile_split(struct pcapfile *F, const int nworkers, const int pkt_offset);
+int pcapfile_dispatch_share(struct pcapfile *F, const int id, const int cnt, void (*callback)(u_char *, const struct pcap_pkthdr *, const u_char *), u_char *user, time_t *clock);
+int pcapfile_timespan(struct pcapfile *F, time_t *first, time_t *last);
+void pcapfile_close(struct pcapfile *F);
+
+/* pattern.c */
+typedef struct pattern *pattern;
+
+pattern pattern_new(const unsigned char *needle, const size_t len);
+void pattern_delete(pattern P);
+unsigned char *pattern_find(const pattern P, const unsigned char *data, const size_t len);
+unsigned char *pattern_find_generic(const pattern P, const unsigned char *data, const size_t len);
+
+/* struct bytepair:
+ * Two bytes which start something we look for: FIRST, followed by a byte
+ * which, masked with MASK, is SECOND. */
+struct bytepair {
+    unsigned char first, second, mask;
+};
+
+#define MAX_PAIRS       8       /* one bit each in pair_avx2 */
+unsigned char *memchr_pair(const unsigned char *data, const size_t len, const struct bytepair *pairs, const int npairs);
+
+/* pool.c */
+slab slab_new(const size_t size);
+void slab_delete(slab S);
+void *slab_alloc(slab S);
+void slab_free(slab S, void *v);
+void slab_stats(const slab S, struct allocstats *A);
+bufpool bufpool_new(void);
+void bufpool_delete(bufpool P);
+void *bufpool_get(bufpool P, size_t *size);
+void bufpool_put(bufpool P, void *v, size_t size);
+void *bufpool_resize(bufpool P, void *v, size_t *size, const size_t keep, const size_t want);
+void bufpool_stats(const bufpool P, struct allocstats *A);
+size_t bufpool_inuse(const bufpool P);
+
+/* sigscan.c */
+/* Bits for the signatures of each media type; bit i corresponds to the media
+ * driver with index i in media.c. */
+#define SIG_GIF         0x01
+#define SIG_JPEG        0x02
+#define SIG_PNG         0x04
+#define SIG_MPEG        0x08
+#define SIG_HTTP        0x10
+
+/* struct sigcand:
+ * A place where one or more signatures were found. */
+struct sigcand {
+    size_t off;
+    int sigs;
+};
+
+/* enum streamtype:
+ * What the first bytes of a stream say it carries. */
+enum streamtype { st_unknown, st_request, st_upload, st_response, st_media, st_tls, st_ssh };
+
+enum streamtype classify_stream(const unsigned char *data, const size_t len);
+int match_sigs(const unsigned char *data, const size_t avail, const int sigs);
+size_t check_media(const int i, const unsigned char *data, const size_t len);
+size_t sigscan(const unsigned char *data, const size_t len, const size_t avail, const int sigs, struct sigcand *cand, const size_t ncand, size_t *scanned);
+void scan_media(const unsigned char *data, const size_t len, int *moff, struct mediastate *mstate, const int sigs, void (*found)(const int i, const unsigned char *media, const size_t mlen, void *arg), void *arg);
+
 /* util.c */
 void *xmalloc(size_t n);
 void *xcalloc(size_t n, size_t m);
@@ -14,22 +14,38 @@ static const char rcsid[] = "$Id: http.c,v 1.1 2003/08/12 14:14:15 chris Exp $";
 
 #include <sys/types.h>
 
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "driftnet.h"
 
-/* find_http_req DATA LEN FOUND FOUNDLEN
- * Look for an HTTP request and response in buffer DATA of length LEN. The
- * return value is a pointer into DATA suitable for a subsequent call to this
- * function; *FOUND is either NULL, or a pointer to the start of an HTTP
- * request; in the latter case, *FOUNDLEN is the length of the match
- * containing enough information to obtain the URL. */
-unsigned char *find_http_req(const unsigned char *data, const size_t len, unsigned char **http, size_t *httplen) {
-    unsigned char *req, *le, *blankline, *hosthdr;
-    
-#define remaining(x)    (len - (data - (x)))
 #define MAX_REQ         16384
+
+static pattern p_get, p_crlf, p_blankline, p_host;
+static pthread_once_t patterns_once = PTHREAD_ONCE_INIT;
+
+/* compile_patterns:
+ * Compile the strings we look for. */
+static void compile_patterns(void) {
+    p_get       = pattern_new((unsigned char*)"GET ", 4);
+    p_crlf      = pattern_new((unsigned char*)"\r\n", 2);
+    p_blankline = pattern_new((unsigned char*)"\r\n\r\n", 4);
+    p_host      = pattern_new((unsigned char*)"\r\nHost: ", 8);
+}
+
+/* Where the request parser may be when it runs out of data. */
+#define HTTP_REQLINE    0       /* looking for the end of the request line */
+#define HTTP_HEADERS    1       /* looking for the end of the headers */
+
+/* check_http_req DATA LEN STATE FOUND FOUNDLEN
+ * DATA, of length LEN, starts with "GET "; see whether it's a whole HTTP
+ * request. Returns as check_gif_image does. STATE->pos is where to carry on
+ * searching, and STATE->count the offset of the end of the request line. */
+unsigned char *check_http_req(const unsigned char *data, const size_t len, struct mediastate *S, unsigned char **http, size_t *httplen) {
+    unsigned char *req = (unsigned char*)data, *le, *blankline, *hosthdr;
+    
+#define remaining(x)    (len - ((x) - data))
     
     /* HTTP requests look like:
      *
@@ -39,34 +55,47 @@ unsigned char *find_http_req(const unsigned char *data, const size_t len, unsign
      *      \r\n
      *
      * We may care about the Host: header in the request. */
-    if (len < 40)
-        return (unsigned char*)data;
-    
-    if (!(req = memstr(data, len, (unsigned char*) "GET ", 4)))
-        return (unsigned char*)(data + len - 4);
+    pthread_once(&patterns_once, compile_patterns);
 
-    /* Find the end of the request line. */
-    if (!(le = memstr(req + 4, remaining(req + 4), (unsigned char*) "\r\n", 2))) {
-        if (remaining(req + 4) > MAX_REQ)
-            return (unsigned char*)(req + 4);
-        else
-            return (unsigned char*)req;
+    *http = NULL;
+
+    if (S->pos == 0) {
+        S->phase = HTTP_REQLINE;
+        S->pos = 4;
     }
 
-    /* Not enough space for a path. */
-    if (le < req + 5)
-        return le + 2;
+    if (S->phase == HTTP_REQLINE) {
+        /* Find the end of the request line. */
+        if (!(le = pattern_find(p_crlf, req + S->pos, remaining(req + S->pos)))) {
+            if (remaining(req + 4) > MAX_REQ)
+                return (unsigned char*)(req + 4);
+            /* The line ending may be split across the end of the data. */
+            if (len - 1 > (size_t)S->pos)
+                S->pos = len - 1;
+            return (unsigned char*)req;
+        }
 
-    /* Not an HTTP request, just a line starting GET.... */
-    if (memcmp(le - 9, " HTTP/1.", 8) || !strchr("01", (int)*(le - 1)))
-        return le + 2;
+        /* Not enough space for a path and protocol version. */
+        if (le < req + 14)
+            return le + 2;
+
+        /* Not an HTTP request, just a line starting GET.... */
+        if (memcmp(le - 9, " HTTP/1.", 8) || !strchr("01", (int)*(le - 1)))
+            return le + 2;
+
+        S->phase = HTTP_HEADERS;
+        S->count = le - req;
+        S->pos = le + 2 - req;
+    } else
+        le = req + S->count;
 
     /* Find the end of the request headers. */
-    if (!(blankline = memstr(le + 2, remaining(le + 2), (unsigned char*) "\r\n\r\n", 4))) {
+    if (!(blankline = pattern_find(p_blankline, req + S->pos, remaining(req + S->pos)))) {
         if (remaining(le + 2) > MAX_REQ)
             return (unsigned char*)(data + len - 4);
-        else
-            return req;
+        if (len - 3 > (size_t)S->pos)
+            S->pos = len - 3;
+        return req;
     }
 
     if (memcmp(req + 4, "http://", 7) == 0)
@@ -74,7 +103,7 @@ unsigned char *find_http_req(const unsigned char *data, const size_t len, unsign
         goto found;
 
     /* Is there a Host: header? */
-    if (!(hosthdr = memstr(le, blankline - le + 2, (unsigned char*) "\r\nHost: ", 8))) {
+    if (!(hosthdr = pattern_find(p_host, le, blankline - le + 2))) {
         return blankline + 4;
     }
 
@@ -86,13 +115,38 @@ found:
     return blankline + 4;
 }
 
+/* find_http_req DATA LEN FOUND FOUNDLEN
+ * Look for an HTTP request and response in buffer DATA of length LEN. The
+ * return value is a pointer into DATA suitable for a subsequent call to this
+ * function; *FOUND is either NULL, or a pointer to the start of an HTTP
+ * request; in the latter case, *FOUNDLEN is the length of the match
+ * containing enough information to obtain the URL. */
+unsigned char *find_http_req(const unsigned char *data, const size_t len, unsigned char **http, size_t *httplen) {
+    unsigned char *req;
+    struct mediastate S = {0};
+
+    pthread_once(&patterns_once, compile_patterns);
+
+    *http = NULL;
+
+    if (len < 40)
+        return (unsigned char*)data;
+    
+    if (!(req = pattern_find(p_get, data, len)))
+        return (unsigned char*)(data + len - 4);
+
+    return check_http_req(req, len - (req - data), &S, http, httplen);
+}
+
 void dispatch_http_req(const char *mname, const unsigned char *data, const size_t len) {
     char *url;
     const char *path, *host;
     int pathlen, hostlen;
     const unsigned char *p;
+
+    pthread_once(&patterns_once, compile_patterns);
     
-    if (!(p = memstr(data, len, (unsigned char*) "\r\n", 2)))
+    if (!(p = pattern_find(p_crlf, data, len)))
         return;
     
     path = (const char*)(data + 4);
@@ -103,12 +157,12 @@ void dispatch_http_req(const char *mname, const unsigned char *data, const size_
         sprintf(url, "%.*s", pathlen, path);
     } else {
 
-        if (!(p = memstr(p, len - (p - data), (unsigned char*) "\r\nHost: ", 8)))
+        if (!(p = pattern_find(p_host, p, len - (p - data))))
             return;
 
         host = (const char*)(p + 8);
     
-        if (!(p = memstr(p + 8, len - (p + 8 - data), (unsigned char*) "\r\n", 2)))
+        if (!(p = pattern_find(p_crlf, p + 8, len - (p + 8 - data))))
             return;
         hostlen = p - (const unsigned char*)host;
 
@@ -0,0 +1,474 @@
+/*
+ * httpresp.c:
+ * Follow a stream of HTTP responses from one to the next.
+ *
+ * Most of the media we see come from web servers, and a stream of responses
+ * says exactly where each object in it starts and ends: the headers give the
+ * length of a body, or it is sent in chunks each of which gives its own, and
+ * on a persistent connection the next response follows straight after. So for
+ * such a stream, rather than searching all of the data for signatures, we
+ * read the headers and look at the start of each body; one which is media,
+ * as its driver's parser confirms, is handed to that driver whole. Any other
+ * body may still have media inside it, as the frames of a webcam's
+ * multipart/x-mixed-replace stream do, so it is searched in the usual way,
+ * but only as far as it goes; compressed bodies are stepped over without
+ * looking at them, even if we are missing some of them. If the stream turns
+ * out not to be what we expect, or the connection ends while we are waiting
+ * for part of it, we give up and search the rest of it for media.
+ *
+ * Copyright (c) 2004 Chris Lightfoot. All rights reserved.
+ * Email: chris@ex-parrot.com; WWW: http://www.ex-parrot.com/~chris/
+ *
+ */
+
+static const char rcsid[] = "$Id$";
+
+#include <sys/types.h>
+
+#include <ctype.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "driftnet.h"
+
+/* The longest response headers or chunk line we'll wait for, and the largest
+ * chunked body we'll reassemble. */
+#define MAX_HEADERS     65536
+#define MAX_CHUNKLINE   1024
+#define MAX_BODY        (8 * 1024 * 1024)
+
+/* The number of bytes of a body we look at to see what it is. */
+#define SNIFF_LEN       8
+
+static pattern p_crlf, p_blankline, p_chunked;
+static pthread_once_t patterns_once = PTHREAD_ONCE_INIT;
+
+/* compile_patterns:
+ * Compile the strings we look for. */
+static void compile_patterns(void) {
+    p_crlf      = pattern_new((unsigned char*)"\r\n", 2);
+    p_blankline = pattern_new((unsigned char*)"\r\n\r\n", 4);
+    p_chunked   = pattern_new((unsigned char*)"chunked", 7);
+}
+
+/* struct httpresp:
+ * Where we have got to in the stream. POS is the offset in the stream of the
+ * next byte we need to look at; the bytes before it are no longer needed. */
+struct httpresp {
+    enum {
+        hr_headers,     /* at the start of a response */
+        hr_body,        /* in a body of known length */
+        hr_toclose,     /* in a body which runs to the end of the stream */
+        hr_chunksize,   /* at the start of a chunk */
+        hr_chunk,       /* in the data of a chunk */
+        hr_chunkend,    /* at the line ending after the data of a chunk */
+        hr_trailer      /* in the trailer after the last chunk */
+    } phase;
+    unsigned int pos;
+    /* Nonzero if we have lost data which we needed. */
+    int lost;
+    /* The number of bytes of the body or chunk still to come. */
+    unsigned int remain;
+    /* What the body is: -1 if we haven't looked yet, 0 if nothing we
+     * recognise, or the SIG_ bit of the driver which wants it. */
+    int sig;
+    /* Nonzero if the body is to be searched for media. */
+    int search;
+    /* Where the search has got to, and the parsers' states, as for a block;
+     * in a body of known length or one which runs to the end of the stream,
+     * the offsets are from POS, and otherwise from the start of BUF. */
+    int moff[NMEDIATYPES];
+    struct mediastate mstate[NMEDIATYPES];
+    /* The body so far, if it is chunked and we want it. */
+    unsigned char *buf;
+    size_t buflen, bufalloc;
+};
+
+/* httpresp_new CONNECTION
+ * Start following HTTP responses in CONNECTION, whose stream starts with
+ * one. */
+void httpresp_new(connection c) {
+    size_t n = sizeof *c->http;
+    pthread_once(&patterns_once, compile_patterns);
+    c->http = bufpool_get(c->pool, &n);
+    memset(c->http, 0, sizeof *c->http);
+    c->http->phase = hr_headers;
+}
+
+/* httpresp_delete CONNECTION
+ * Stop following responses in CONNECTION, and free what we were using to do
+ * so. */
+void httpresp_delete(connection c) {
+    struct httpresp *R;
+    if (!(R = c->http))
+        return;
+    bufpool_put(c->pool, R->buf, R->bufalloc);
+    bufpool_put(c->pool, R, sizeof *R);
+    c->http = NULL;
+}
+
+/* httpresp_abandon CONNECTION
+ * Stop following responses in CONNECTION, and arrange for the rest of its
+ * stream, from where we had got to, to be searched for media instead. */
+void httpresp_abandon(connection c) {
+    struct httpresp *R;
+    struct datablock *b;
+    unsigned int pos[NMEDIATYPES];
+    int i;
+
+    if (!(R = c->http))
+        return;
+    /* If we were part way through searching a body, each parser carries on
+     * from where it had got to in it, so that nothing is found twice. */
+    for (i = 0; i < NMEDIATYPES; ++i)
+        if (R->lost)
+            pos[i] = 0;
+        else if (R->search && (R->phase == hr_body || R->phase == hr_toclose))
+            pos[i] = R->pos + R->moff[i];
+        else
+            pos[i] = R->pos;
+    httpresp_delete(c);
+
+    for (b = c->blocks; b < c->blocks + c->nblocks; ++b) {
+        b->dirty = 0;
+        for (i = 0; i < NMEDIATYPES; ++i) {
+            if ((unsigned int)(b->off + b->len) <= pos[i])
+                b->moff[i] = b->len;
+            else if ((unsigned int)b->off < pos[i])
+                b->moff[i] = pos[i] - b->off;
+            else
+                b->moff[i] = 0;
+            if (b->moff[i] < b->len)
+                b->dirty = 1;
+        }
+        memset(b->mstate, 0, sizeof b->mstate);
+    }
+}
+
+/* httpresp_discard CONNECTION UPTO
+ * Called when the first UPTO bytes of CONNECTION's stream are thrown away. */
+void httpresp_discard(connection c, const unsigned int upto) {
+    struct httpresp *R = c->http;
+
+    if (R->pos >= upto)
+        R->pos -= upto;
+    else {
+        /* We needed some of those; this happens only when we have been
+         * waiting for something so long that the connection has had to drop
+         * it. */
+        R->pos = 0;
+        R->lost = 1;
+    }
+}
+
+/* httpresp_keep CONNECTION
+ * Return the offset in CONNECTION's stream before which we no longer need
+ * the data. */
+unsigned int httpresp_keep(const connection c) {
+    return c->http->lost ? 0 : c->http->pos;
+}
+
+/* find_crlf DATA LEN
+ * Return the offset of the first CRLF in DATA, of length LEN, or -1 if there
+ * isn't one. */
+static int find_crlf(const unsigned char *data, const unsigned int len) {
+    unsigned char *p;
+    return (p = pattern_find(p_crlf, data, len)) ? p - data : -1;
+}
+
+/* header_value LINE LEN NAME
+ * If LINE, of length LEN, is a header called NAME, return a pointer to the
+ * value in it, after any leading space; otherwise return NULL. */
+static const unsigned char *header_value(const unsigned char *line, const unsigned int len, const char *name) {
+    size_t n = strlen(name);
+    const unsigned char *v;
+    if (len <= n || line[n] != ':' || strncasecmp((const char*)line, name, n))
+        return NULL;
+    for (v = line + n + 1; v < line + len && (*v == ' ' || *v == '\t'); ++v);
+    return v;
+}
+
+/* parse_headers RESPONSE DATA LEN
+ * Read the headers, DATA, of length LEN, which end with a blank line, of a
+ * response, and set up RESPONSE to deal with what follows them. Returns 0 if
+ * they make no sense. */
+static int parse_headers(struct httpresp *R, const unsigned char *data, const unsigned int len) {
+    const unsigned char *p, *end = data + len, *v;
+    unsigned long clen = 0;
+    int status, haveclen = 0, chunked = 0, encoded = 0, l;
+
+    /* HTTP/1.x NNN reason */
+    if (len < 12 || memcmp(data, "HTTP/1.", 7) || data[8] != ' '
+        || data[9] < '1' || data[9] > '5' || data[10] < '0' || data[10] > '9' || data[11] < '0' || data[11] > '9')
+        return 0;
+    status = (data[9] - '0') * 100 + (data[10] - '0') * 10 + (data[11] - '0');
+
+    for (p = data; (l = find_crlf(p, end - p)) > 0; p += l + 2) {
+        if ((v = header_value(p, l, "Content-Length"))) {
+            if (v == p + l || !isdigit(*v))
+                return 0;
+            for (clen = 0; v < p + l && isdigit(*v); ++v)
+                if ((clen = clen * 10 + (*v - '0')) > UINT_MAX)
+                    return 0;
+            haveclen = 1;
+        } else if ((v = header_value(p, l, "Transfer-Encoding")))
+            chunked = !!pattern_find(p_chunked, v, p + l - v);
+        else if ((v = header_value(p, l, "Content-Encoding")))
+            encoded = (p + l - v < 8 || strncasecmp((const char*)v, "identity", 8));
+    }
+
+    if ((status >= 100 && status < 200) || status == 204 || status == 304) {
+        /* No body; an interim 1xx response is followed by another. */
+        R->phase = hr_headers;
+        return 1;
+    }
+
+    /* Compressed media aren't anything we can use. */
+    R->sig = encoded ? 0 : -1;
+    R->search = 0;
+    if (chunked)
+        R->phase = hr_chunksize;
+    else if (haveclen) {
+        R->remain = clen;
+        R->phase = clen ? hr_body : hr_headers;
+    } else
+        R->phase = hr_toclose;
+    return 1;
+}
+
+/* sniff RESPONSE DATA AVAIL SIGS
+ * Decide which of SIGS, if any, the body starting at DATA, of which AVAIL
+ * bytes are available and RESPONSE->remain are in this chunk or body, is.
+ * Returns 0 if we need more data to tell. */
+static int sniff(struct httpresp *R, const unsigned char *data, const unsigned int avail, const int sigs) {
+    unsigned int need = R->remain < SNIFF_LEN ? R->remain : SNIFF_LEN;
+    int s;
+
+    if (avail < need)
+        return 0;
+    if (avail == 0)
+        s = 0;
+    else if ((s = match_sigs(data, avail < R->remain ? avail : R->remain, sigs)) == -1)
+        s = 0;
+    /* Use the first driver which wants it, or failing that, search it. */
+    R->sig = s & -s;
+    if ((R->search = !R->sig)) {
+        memset(R->moff, 0, sizeof R->moff);
+        memset(R->mstate, 0, sizeof R->mstate);
+    }
+    return 1;
+}
+
+/* search_body RESPONSE DATA LEN SIGS FOUND ARG
+ * Search the LEN bytes of a body at DATA, the first of which is at
+ * RESPONSE->pos, for media of the types in SIGS, carrying on from where we
+ * got to last time and calling FOUND with ARG for each object. Returns the
+ * number of bytes at the start of DATA which no parser needs any more; the
+ * offsets in RESPONSE are made relative to the byte after them. */
+static unsigned int search_body(struct httpresp *R, const unsigned char *data, const unsigned int len, const int sigs, void (*found)(const int i, const unsigned char *media, const size_t mlen, void *arg), void *arg) {
+    unsigned int skip = len;
+    int i;
+
+    scan_media(data, len, R->moff, R->mstate, sigs, found, arg);
+
+    for (i = 0; i < NMEDIATYPES; ++i)
+        if ((sigs & (1 << i)) && (unsigned int)R->moff[i] < skip)
+            skip = R->moff[i];
+    for (i = 0; i < NMEDIATYPES; ++i) {
+        R->moff[i] = (unsigned int)R->moff[i] > skip ? R->moff[i] - skip : 0;
+        if ((unsigned int)R->mstate[i].start < skip)
+            memset(R->mstate + i, 0, sizeof R->mstate[i]);
+        else
+            R->mstate[i].start -= skip;
+    }
+    return skip;
+}
+
+/* body_append CONNECTION DATA LEN
+ * Add LEN bytes of DATA to the chunked body being reassembled in
+ * CONNECTION; if that makes it too long, forget it. */
+static void body_append(connection c, const unsigned char *data, const unsigned int len) {
+    struct httpresp *R = c->http;
+    if (R->buflen + len > MAX_BODY) {
+        bufpool_put(c->pool, R->buf, R->bufalloc);
+        R->buf = NULL;
+        R->buflen = R->bufalloc = 0;
+        R->sig = R->search = 0;
+        return;
+    }
+    if (R->buflen + len > R->bufalloc)
+        R->buf = bufpool_resize(c->pool, R->buf, &R->bufalloc, R->buflen, R->buflen + len);
+    memcpy(R->buf + R->buflen, data, len);
+    R->buflen += len;
+}
+
+/* sig_index SIG
+ * Return the index of the driver whose SIG_ bit is SIG. */
+static int sig_index(const int sig) {
+    int i;
+    for (i = 0; !(sig & (1 << i)); ++i);
+    return i;
+}
+
+/* httpresp_frame CONNECTION SIGS FOUND ARG
+ * Follow the responses in CONNECTION as far as we can, calling FOUND with
+ * ARG, as scan_media does, for each body which is one of the media types in
+ * SIGS. Returns 1 if the connection should go on being followed, or 0 if we
+ * have given up and the rest of it should be searched instead. */
+int httpresp_frame(connection c, const int sigs, void (*found)(const int i, const unsigned char *media, const size_t mlen, void *arg), void *arg) {
+    struct httpresp *R = c->http;
+
+    if (R->lost)
+        goto fail;
+
+    for (;;) {
+        unsigned char *p, *q;
+        unsigned int n, m;
+        int l;
+
+        p = connection_data(c, R->pos, &n);
+
+        switch (R->phase) {
+            case hr_headers:
+                /* Wait for all of the headers, which must start with a
+                 * status line. */
+                if (n < 5)
+                    return 1;
+                if (memcmp(p, "HTTP/", 5))
+                    goto fail;
+                if (!(q = pattern_find(p_blankline, p, n < MAX_HEADERS ? n : MAX_HEADERS))) {
+                    if (n >= MAX_HEADERS)
+                        goto fail;
+                    return 1;
+                }
+                l = q + 4 - p;
+                if (!parse_headers(R, p, l))
+                    goto fail;
+                R->pos += l;
+                break;
+
+            case hr_body:
+                if (R->sig == -1) {
+                    /* The reply to a HEAD request gives the length of a body
+                     * which isn't sent; what follows is the next response. */
+                    if (n >= 7 && R->remain >= 7 && memcmp(p, "HTTP/1.", 7) == 0) {
+                        R->phase = hr_headers;
+                        break;
+                    }
+                    if (!sniff(R, p, n, sigs))
+                        return 1;
+                }
+                if (R->search) {
+                    /* Search the body as it arrives, keeping only what the
+                     * parsers still need of it. */
+                    if (n < R->remain) {
+                        if (n > 0) {
+                            m = search_body(R, p, n, sigs, found, arg);
+                            R->pos += m;
+                            R->remain -= m;
+                        }
+                        return 1;
+                    }
+                    search_body(R, p, R->remain, sigs, found, arg);
+                } else if (R->sig) {
+                    /* Wait for the whole body, and pass it on as it is if
+                     * it is what it looked like. */
+                    if (n < R->remain)
+                        return 1;
+                    if (check_media(sig_index(R->sig), p, R->remain))
+                        found(sig_index(R->sig), p, R->remain, arg);
+                }
+                /* Anything else we can step over without having seen. */
+                R->pos += R->remain;
+                R->remain = 0;
+                R->phase = hr_headers;
+                break;
+
+            case hr_toclose:
+                /* The body ends when the connection does, at which point we
+                 * will be abandoned and the rest of it searched. Until then,
+                 * one we recognise must wait, one we don't is searched as it
+                 * arrives, and one we can't use is thrown away. */
+                R->remain = UINT_MAX;
+                if (R->sig == -1 && !sniff(R, p, n, sigs))
+                    return 1;
+                if (R->search) {
+                    if (n > 0)
+                        R->pos += search_body(R, p, n, sigs, found, arg);
+                } else if (!R->sig)
+                    R->pos = c->len;
+                return 1;
+
+            case hr_chunksize:
+                /* hex-size [; extensions] CRLF */
+                if ((l = find_crlf(p, n < MAX_CHUNKLINE ? n : MAX_CHUNKLINE)) == -1) {
+                    if (n >= MAX_CHUNKLINE)
+                        goto fail;
+                    return 1;
+                }
+                R->remain = 0;
+                for (m = 0; m < (unsigned int)l && isxdigit(p[m]); ++m) {
+                    if (R->remain > (UINT_MAX >> 4))
+                        goto fail;
+                    R->remain = (R->remain << 4) | (isdigit(p[m]) ? p[m] - '0' : tolower(p[m]) - 'a' + 10);
+                }
+                if (m == 0)
+                    goto fail;
+                R->pos += l + 2;
+                R->phase = R->remain ? hr_chunk : hr_trailer;
+                break;
+
+            case hr_chunk:
+                /* Reassemble a body we want or must search, and step over
+                 * anything else. */
+                if (R->sig == -1 && !sniff(R, p, n, sigs))
+                    return 1;
+                if (R->sig || R->search) {
+                    if (!(m = n < R->remain ? n : R->remain))
+                        return 1;
+                    body_append(c, p, m);
+                } else
+                    m = R->remain;
+                R->pos += m;
+                if (!(R->remain -= m))
+                    R->phase = hr_chunkend;
+                break;
+
+            case hr_chunkend:
+                if (n < 2)
+                    return 1;
+                if (memcmp(p, "\r\n", 2))
+                    goto fail;
+                R->pos += 2;
+                R->phase = hr_chunksize;
+                break;
+
+            case hr_trailer:
+                /* Trailer headers, if any, then a blank line. */
+                if ((l = find_crlf(p, n < MAX_CHUNKLINE ? n : MAX_CHUNKLINE)) == -1) {
+                    if (n >= MAX_CHUNKLINE)
+                        goto fail;
+                    return 1;
+                }
+                R->pos += l + 2;
+                if (l == 0) {
+                    if (R->sig > 0 && R->buflen > 0 && check_media(sig_index(R->sig), R->buf, R->buflen))
+                        found(sig_index(R->sig), R->buf, R->buflen, arg);
+                    else if (R->search && R->buflen > 0)
+                        scan_media(R->buf, R->buflen, R->moff, R->mstate, sigs, found, arg);
+                    bufpool_put(c->pool, R->buf, R->bufalloc);
+                    R->buf = NULL;
+                    R->buflen = R->bufalloc = 0;
+                    R->phase = hr_headers;
+                }
+                break;
+        }
+    }
+
+fail:
+    httpresp_abandon(c);
+    return 0;
+}
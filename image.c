@@ -9,6 +9,7 @@
 
 static const char rcsid[] = "$Id: image.c,v 1.13 2003/08/25 12:23:43 chris Exp $";
 
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -18,38 +19,81 @@ static const char rcsid[] = "$Id: image.c,v 1.13 2003/08/25 12:23:43 chris Exp $
 
 #include "driftnet.h"
 
-/* If we run out of space, put us back to the last candidate GIF header. */
-/*#define spaceleft       do { if (block > data + len) { printf("ran out of space\n"); return gifhdr; } } while (0)*/
-#define spaceleft       if (block >= data + len) return gifhdr /* > ?? */
+static pattern p_gif89a, p_gif87a, p_jpeg_soi, p_jpeg_eoi, p_png_sig;
+static pthread_once_t patterns_once = PTHREAD_ONCE_INIT;
+
+/* compile_patterns:
+ * Compile the signatures we look for. */
+static void compile_patterns(void) {
+    p_gif89a   = pattern_new((unsigned char*)"GIF89a", 6);
+    p_gif87a   = pattern_new((unsigned char*)"GIF87a", 6);
+    p_jpeg_soi = pattern_new((unsigned char*)"\xff\xd8", 2);
+    p_jpeg_eoi = pattern_new((unsigned char*)"\xff\xd9", 2);
+    p_png_sig  = pattern_new((unsigned char*)"\x89\x50\x4e\x47\x0d\x0a\x1a\x0a", PNG_SIG_LEN);
+}
 
-unsigned char *find_gif_image(const unsigned char *data, const size_t len, unsigned char **gifdata, size_t *giflen) {
-    unsigned char *gifhdr, *block;
-    int gotimgblock = 0;
+/* Where the GIF parser may be when it runs out of data. */
+#define GIF_BLOCK       0       /* at the start of a block */
+#define GIF_SUBBLOCK    1       /* at the length of a data sub-block */
+#define GIF_MORE        2       /* after a sub-block; is there another? */
+
+/* If we run out of space in the middle of a block header, wait for more data
+ * and then look at the whole header again. */
+#define gif_wait(b, ph)     do { S->pos = (b) - gifhdr; S->phase = (ph); return gifhdr; } while (0)
+#define spaceleft           if (block >= data + len) gif_wait(blockhdr, GIF_BLOCK)
+
+/* check_gif_image DATA LEN STATE GIFDATA GIFLEN
+ * DATA, of length LEN, starts with a GIF signature; see whether it is a whole
+ * image. Returns a pointer beyond the image, if there is one, in which case
+ * *GIFDATA and *GIFLEN give the image; DATA if we need more data to tell, in
+ * which case STATE records how far we got, so that we can carry on from there
+ * next time; or some other pointer into DATA at which to carry on looking. */
+unsigned char *check_gif_image(const unsigned char *data, const size_t len, struct mediastate *S, unsigned char **gifdata, size_t *giflen) {
+    unsigned char *gifhdr = (unsigned char*)data, *block, *blockhdr;
     int ncolours;
 
     *gifdata = NULL;
 
-    if (len < 6) return (unsigned char*)data;
-
-    gifhdr = memstr(data, len, (unsigned char*) "GIF89a", 6);
-    if (!gifhdr) gifhdr = memstr(data, len, (unsigned char*) "GIF87a", 6);
-    if (!gifhdr) return (unsigned char*)(data + len - 6);
-    if (data + len - gifhdr < 14) return gifhdr; /* no space for header */
+    if (S->pos == 0) {
+        if (len < 14) return gifhdr; /* no space for header */
 
-    ncolours = (1 << ((gifhdr[10] & 0x7) + 1));
-    /* printf("gif header %d colours\n", ncolours); */
-    block = gifhdr + 13;
-    spaceleft;
-    if (gifhdr[10] & 0x80) block += 3 * ncolours; /* global colour table */
-    spaceleft;
+        ncolours = (1 << ((gifhdr[10] & 0x7) + 1));
+        /* printf("gif header %d colours\n", ncolours); */
+        block = gifhdr + 13;
+        if (gifhdr[10] & 0x80) block += 3 * ncolours; /* global colour table */
+        if (block >= data + len) return gifhdr;
+        S->phase = GIF_BLOCK;
+    } else
+        block = gifhdr + S->pos;
 
     do {
-         /* printf("gifhdr = %p block = %p off = %u %02x\n", gifhdr, block, block - gifhdr, (unsigned int)*block); */
+        switch (S->phase) {
+            case GIF_SUBBLOCK:
+                if (block >= data + len) gif_wait(block, GIF_SUBBLOCK);
+                block += *block + 1;
+                /* fall through */
+
+            case GIF_MORE:
+                if (block >= data + len) gif_wait(block, GIF_MORE);
+                if (*block)
+                    S->phase = GIF_SUBBLOCK;
+                else {
+                    ++block;
+                    S->phase = GIF_BLOCK;
+                }
+                continue;
+        }
+
+        /* At the start of a block. */
+        blockhdr = block;
+        spaceleft;
+
+        /* printf("gifhdr = %p block = %p off = %u %02x\n", gifhdr, block, block - gifhdr, (unsigned int)*block); */
         switch (*block) {
             case 0x2c:
                 /* image block */
                 /* printf("image data\n"); */
-                if (block + 9 > data + len) return gifhdr;
+                if (block + 9 > data + len) gif_wait(blockhdr, GIF_BLOCK);
                 if (block[9] & 0x80) {
                     /* local colour table */
                     block += 3 * ((1 << ((gifhdr[9] & 0x7) + 1)));
@@ -57,15 +101,7 @@ unsigned char *find_gif_image(const unsigned char *data, const size_t len, unsig
                 }
                 block += 10;
                 ++block;        /* lzw code size */
-                do {
-                    spaceleft;
-                    block += *block + 1;
-                    spaceleft;
-                } while (*block);
-                ++block;
-                spaceleft;
-                gotimgblock = 1;
-
+                S->phase = GIF_SUBBLOCK;
                 break;
 
             case 0x21:
@@ -84,13 +120,7 @@ unsigned char *find_gif_image(const unsigned char *data, const size_t len, unsig
                     /* comment */
                     /* printf("comment\n"); */
                     ++block;
-                    do {
-                        spaceleft;
-                        block += *block + 1;
-                        spaceleft;
-                    } while (*block);
-                    ++block;
-                    spaceleft;
+                    S->phase = GIF_SUBBLOCK;
                 } else if (*block == 0x01) {
                     /* text label */
                     /* printf("text label\n"); */
@@ -98,27 +128,14 @@ unsigned char *find_gif_image(const unsigned char *data, const size_t len, unsig
                     spaceleft;
                     if (*block != 12) return gifhdr + 6;
                     block += 13;
-                    do {
-                        spaceleft;
-                        block += *block + 1;
-                        spaceleft;
-                    } while (*block);
-                    ++block;
-                    spaceleft;
+                    S->phase = GIF_SUBBLOCK;
                 } else if (*block == 0xff) {
                     /* printf("application extension\n"); */
                     ++block;
                     spaceleft;
                     if (*block != 11) return gifhdr + 6;
                     block += 12;
-                    do {
-                        spaceleft;
-                        /* printf("app extension data %d bytes\n", (int)*block); */
-                        block += *block + 1;
-                        spaceleft;
-                    } while (*block);
-                    ++block;
-                    spaceleft;
+                    S->phase = GIF_SUBBLOCK;
                 } else {
                     /* printf("unknown extension block\n"); */
                     return gifhdr + 6;
@@ -140,6 +157,23 @@ unsigned char *find_gif_image(const unsigned char *data, const size_t len, unsig
     } while (1);
 }
 
+unsigned char *find_gif_image(const unsigned char *data, const size_t len, unsigned char **gifdata, size_t *giflen) {
+    unsigned char *gifhdr;
+    struct mediastate S = {0};
+
+    *gifdata = NULL;
+
+    pthread_once(&patterns_once, compile_patterns);
+
+    if (len < 6) return (unsigned char*)data;
+
+    gifhdr = pattern_find(p_gif89a, data, len);
+    if (!gifhdr) gifhdr = pattern_find(p_gif87a, data, len);
+    if (!gifhdr) return (unsigned char*)(data + len - 6);
+
+    return check_gif_image(gifhdr, len - (gifhdr - data), &S, gifdata, giflen);
+}
+
 /* If we run out of space, put us back to the last candidate JPEG header. */
 
 #define jpegcount(c)    ((*(c) << 8) | *((c) + 1))
@@ -163,58 +197,96 @@ unsigned char *jpeg_skip_block(unsigned char *d, size_t len) {
     return d + l;
 }
 
-unsigned char *find_jpeg_image(const unsigned char *data, const size_t len, unsigned char **jpegdata, size_t *jpeglen) {
-    unsigned char *jpeghdr, *block;
+/* Where the JPEG parser may be when it runs out of data. */
+#define JPEG_MARKER     0       /* looking for the next marker */
+#define JPEG_SCAN       1       /* in the scan, looking for the end of the image */
+
+/* check_jpeg_image DATA LEN STATE JPEGDATA JPEGLEN
+ * As check_gif_image, for a JPEG SOI marker at DATA. STATE->count is the
+ * number of marker segments seen. */
+unsigned char *check_jpeg_image(const unsigned char *data, const size_t len, struct mediastate *S, unsigned char **jpegdata, size_t *jpeglen) {
+    unsigned char *jpeghdr = (unsigned char*)data, *block;
 
     *jpegdata = NULL;
 
-    jpeghdr = memstr(data, len, (unsigned char*) "\xff\xd8", 2); /* JPEG SOI marker */
-    if (!jpeghdr) return (unsigned char*)(data + len - 1);
+    pthread_once(&patterns_once, compile_patterns);
 
     /* printf("SOI marker at %p\n", jpeghdr); */
     
-    if (jpeghdr + 2 > data + len) return jpeghdr;
-    block = jpeg_next_marker(jpeghdr + 2, len - 2 - (jpeghdr - data));
-    /* printf("next block at %p\n", block); */
-    if (!block || (block - data) >= len) return jpeghdr;
-
-    /* now we need to find the onward count from this place */
-    while ((block = jpeg_skip_block(block + 1, len - (block + 1 - data)))) {
-        /* printf("data = %p block = %p\n", data, block); */
+    if (S->pos == 0) {
+        if (jpeghdr + 2 > data + len) return jpeghdr;
+        S->pos = 2;
+        S->phase = JPEG_MARKER;
+        S->count = 0;
+    }
 
-        block = jpeg_next_marker(block, len - (block - data));
-        if (!block || (block - data) >= len) return jpeghdr;
+    /* now we need to find the onward count from each marker */
+    while (S->phase == JPEG_MARKER) {
+        /* Each marker segment is followed directly by the next marker; if
+         * not, this was a stray SOI in some other data. */
+        if ((size_t)S->pos < len && jpeghdr[S->pos] != 0xff)
+            return jpeghdr + 1;
+        block = jpeg_next_marker(jpeghdr + S->pos, len - S->pos);
+        if (!block) return jpeghdr;
 
         /* printf("got block of type %02x\n", *block); */
 
-        if (*block == 0xda) {
-            /* start of scan; dunno how to parse this but just look for end of
-             * image marker. XXX this is broken, fix it! */
-            block = memstr(block, len - (block - data), (unsigned char*) "\xff\xd9", 2);
-            if (block) {
-                *jpegdata = jpeghdr;
-                *jpeglen = block + 2 - jpeghdr;
-                return block + 2;
-            } else break;
+        if (S->count > 0 && *block == 0xda) {
+            S->phase = JPEG_SCAN;
+            S->pos = block - jpeghdr;
+        } else {
+            if (!(block = jpeg_skip_block(block + 1, len - (block + 1 - data))))
+                return jpeghdr;
+            S->pos = block - jpeghdr;
+            ++S->count;
         }
     }
+
+    /* start of scan; dunno how to parse this but just look for end of image
+     * marker. XXX this is broken, fix it! */
+    block = pattern_find(p_jpeg_eoi, jpeghdr + S->pos, len - S->pos);
+    if (block) {
+        *jpegdata = jpeghdr;
+        *jpeglen = block + 2 - jpeghdr;
+        return block + 2;
+    }
+
     /* printf("nope, no complete JPEG here\n"); */
+    /* Next time, look only at the new data, and the last byte of this, in
+     * case the marker is split between them. */
+    if (len - 1 > (size_t)S->pos)
+        S->pos = len - 1;
     return jpeghdr;
 }
 
-/* find_png_eoi BUFFER LEN
+unsigned char *find_jpeg_image(const unsigned char *data, const size_t len, unsigned char **jpegdata, size_t *jpeglen) {
+    unsigned char *jpeghdr;
+    struct mediastate S = {0};
+
+    *jpegdata = NULL;
+
+    pthread_once(&patterns_once, compile_patterns);
+
+    jpeghdr = pattern_find(p_jpeg_soi, data, len); /* JPEG SOI marker */
+    if (!jpeghdr) return (unsigned char*)(data + len - 1);
+
+    return check_jpeg_image(jpeghdr, len - (jpeghdr - data), &S, jpegdata, jpeglen);
+}
+
+/* find_png_eoi BUFFER LEN NEXT
  * Returns the first position in BUFFER of LEN bytes after the end of the image
- * or NULL if end of image not found. */
-unsigned char *find_png_eoi(unsigned char *buffer, const size_t len) {
-    unsigned char *end_data, *data, chunk_code[PNG_CODE_LEN + 1];
+ * or NULL if end of image not found. The chunks are walked from offset *NEXT,
+ * or from just after the signature if it is zero; if the end of the image
+ * isn't found, *NEXT is set to the offset of the first chunk not yet seen. */
+unsigned char *find_png_eoi(unsigned char *buffer, const size_t len, size_t *next) {
+    unsigned char *data, chunk_code[PNG_CODE_LEN + 1];
     struct png_chunk chunk;
     u_int32_t datalen;
 
     /* Move past the PNG header */
-    data = (buffer + PNG_SIG_LEN);
-    end_data = (buffer + len - (sizeof(struct png_chunk) + PNG_CRC_LEN));
+    data = buffer + (*next ? *next : PNG_SIG_LEN);
 
-    while (data <= end_data) {
+    while (data + sizeof(struct png_chunk) + PNG_CRC_LEN <= buffer + len) {
         memcpy(&chunk, data, sizeof chunk);
 /*        chunk = (struct png_chunk *)data; */ /* can't do that. */
         memset(chunk_code, '\0', PNG_CODE_LEN + 1);
@@ -227,36 +299,52 @@ unsigned char *find_png_eoi(unsigned char *buffer, const size_t len) {
 
         /* Would this push us off the end of the buffer? */
         if (datalen > (len - (data - buffer)))
-            return NULL;
+            break;
         
         data += (sizeof(struct png_chunk) + datalen + PNG_CRC_LEN);        
     }
 
+    *next = data - buffer;
     return NULL;
 }
 
+/* check_png_image DATA LEN STATE PNGDATA PNGLEN
+ * As check_gif_image, for a PNG signature at DATA. STATE->pos is the offset
+ * of the next chunk. */
+unsigned char *check_png_image(const unsigned char *data, const size_t len, struct mediastate *S, unsigned char **pngdata, size_t *pnglen) {
+    unsigned char *png_eoi;
+    size_t next = S->pos;
+
+    *pngdata = NULL;
+
+    if ((png_eoi = find_png_eoi((unsigned char*)data, len, &next)) == NULL) {
+        S->pos = next;
+        return (unsigned char*)data;
+    }
+
+    *pngdata = (unsigned char*)data;
+    *pnglen = (png_eoi - data);
+    return png_eoi;
+}
+
 /* find_png_image DATA LEN PNGDATA PNGLEN
  * Look for PNG images in LEN bytes buffer DATA. */
 unsigned char *find_png_image(const unsigned char *data, const size_t len, unsigned char **pngdata, size_t *pnglen) {
-    unsigned char *pnghdr, *data_end, *png_eoi;
+    unsigned char *pnghdr;
+    struct mediastate S = {0};
 
     *pngdata = NULL;
 
+    pthread_once(&patterns_once, compile_patterns);
+
     if (len < PNG_SIG_LEN) 
        return (unsigned char*)data;
 
-    pnghdr = memstr(data, len, (unsigned char*) "\x89\x50\x4e\x47\x0d\x0a\x1a\x0a", PNG_SIG_LEN);
+    pnghdr = pattern_find(p_png_sig, data, len);
     if (!pnghdr)
         return (unsigned char*)(data + len - PNG_SIG_LEN); 
 
-    data_end = (unsigned char *)(data + len);
-
-    if ((png_eoi = find_png_eoi(pnghdr, (data_end - pnghdr))) == NULL)
-        return pnghdr;
-
-    *pngdata = pnghdr;
-    *pnglen = (png_eoi - pnghdr);
-    return png_eoi;
+    return check_png_image(pnghdr, len - (pnghdr - data), &S, pngdata, pnglen);
 }
 
 
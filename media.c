@@ -12,6 +12,7 @@ static const char rcsid[] = "$Id: media.c,v 1.9 2003/08/25 12:23:43 chris Exp $"
 #include <assert.h>
 #include <dirent.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -24,21 +25,23 @@ extern char *tmpdir;    /* in driftnet.c */
 extern int adjunct;
 extern int dpychld_fd;
 
-/* image.c */
-unsigned char *find_gif_image(const unsigned char *data, const size_t len, unsigned char **gifdata, size_t *giflen);
-unsigned char *find_jpeg_image(const unsigned char *data, const size_t len, unsigned char **jpegdata, size_t *jpeglen);
-unsigned char *find_png_image(const unsigned char *data, const size_t len, unsigned char **pngdata, size_t *pnglen);
-
-/* audio.c */
-unsigned char *find_mpeg_stream(const unsigned char *data, const size_t len, unsigned char **mpegdata, size_t *mpeglen);
-
 /* http.c */
-unsigned char *find_http_req(const unsigned char *data, const size_t len, unsigned char **http, size_t *httplen);
 void dispatch_http_req(const char *mname, const unsigned char *data, const size_t len);
 
 /* playaudio.c */
 void mpeg_submit_chunk(const unsigned char *data, const size_t len);
 
+/* Several capture threads may find media at once. This serialises dispatch
+ * of the media found, and the count of temporary files. */
+static pthread_mutex_t dispatch_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+/* Number of media objects dispatched. */
+unsigned long media_count;
+
+static void dispatch_unlock(void *v) {
+    pthread_mutex_unlock(&dispatch_mtx);
+}
+
 int is_driftnet_file(char *filename) {
     if (strncmp(filename, "driftnet-", 9) != 0) return 0;
     char *p = strrchr(filename, '.');
@@ -105,49 +108,84 @@ void dispatch_mpeg_audio(const char *mname, const unsigned char *data, const siz
     mpeg_submit_chunk(data, len);
 }
 
-/* Media types we handle. */
+/* Media types we handle, in the order of the SIG_ bits; the scanning is done
+ * in sigscan.c. */
 static struct mediadrv {
     char *name;
     enum mediatype type;
-    unsigned char *(*find_data)(const unsigned char *data, const size_t len, unsigned char **found, size_t *foundlen);
     void (*dispatch_data)(const char *mname, const unsigned char *data, const size_t len);
 } driver[NMEDIATYPES] = {
-        { "gif",  m_image, find_gif_image,   dispatch_image },
-        { "jpeg", m_image, find_jpeg_image,  dispatch_image },
-        { "png",  m_image, find_png_image,   dispatch_image },
-        { "mpeg", m_audio, find_mpeg_stream, dispatch_mpeg_audio },
-        { "HTTP", m_text,  find_http_req,    dispatch_http_req }
+        { "gif",  m_image, dispatch_image },
+        { "jpeg", m_image, dispatch_image },
+        { "png",  m_image, dispatch_image },
+        { "mpeg", m_audio, dispatch_mpeg_audio },
+        { "HTTP", m_text,  dispatch_http_req }
     };
 
+/* dispatch_media I MEDIA LEN ARG
+ * Callback for scan_media, dispatching an object found by driver I. */
+static void dispatch_media(const int i, const unsigned char *media, const size_t mlen, void *arg) {
+    extern int max_tmpfiles;  /* in driftnet.c */
+
+    /* The capture thread may be cancelled while we are writing, so make sure
+     * that the lock is released if so. */
+    pthread_mutex_lock(&dispatch_mtx);
+    pthread_cleanup_push(dispatch_unlock, NULL);
+    if (!max_tmpfiles || count_temporary_files() < max_tmpfiles) {
+        driver[i].dispatch_data(driver[i].name, media, mlen);
+        ++media_count;
+    }
+    pthread_cleanup_pop(1);
+}
+
+/* The least data worth throwing away from the start of a connection. */
+#define DISCARD_MIN     16384
+
+/* media_sigs TYPE
+ * Return the SIG_ bits of the drivers for media of the given TYPE. */
+int media_sigs(const enum mediatype T) {
+    int i, sigs = 0;
+    for (i = 0; i < NMEDIATYPES; ++i)
+        if (driver[i].type & T)
+            sigs |= 1 << i;
+    return sigs;
+}
+
 /* connection_extract_media CONNECTION TYPE
- * Attempt to extract media data of the given TYPE from CONNECTION. */
+ * Attempt to extract media data of the given TYPE from CONNECTION, using
+ * only those drivers which make sense for it. */
 void connection_extract_media(connection c, const enum mediatype T) {
     struct datablock *b;
-    extern int max_tmpfiles;  /* in driftnet.c */
+    int i, sigs, framed;
+
+    sigs = media_sigs(T) & c->sigs;
 
-    /* Walk through the list of blocks and try to extract media data from
+    /* In a stream of HTTP responses, only the bodies need be looked at;
+     * otherwise, walk through the blocks and try to extract media data from
      * those which have changed. */
-    for (b = c->blocks; b; b = b->next) {
-        if (b->len > 0 && b->dirty) {
-            int i;
-            for (i = 0; i < NMEDIATYPES; ++i)
-                if (driver[i].type & T) {
-                    unsigned char *ptr, *oldptr, *media;
-                    size_t mlen;
-
-                    ptr = c->data + b->off + b->moff[i];
-                    oldptr = NULL;
-
-                    while (ptr != oldptr && ptr < c->data + b->off + b->len) {
-                        oldptr = ptr;
-                        ptr = driver[i].find_data(ptr, (b->off + b->len) - (ptr - c->data), &media, &mlen);
-                        if (media && (!max_tmpfiles || count_temporary_files() < max_tmpfiles))
-                            driver[i].dispatch_data(driver[i].name, media, mlen);
-                    }
-
-                    b->moff[i] = ptr - c->data - b->off;
-                }
-            b->dirty = 0;
+    if (!(framed = (c->http && httpresp_frame(c, sigs, dispatch_media, NULL)))) {
+        for (b = c->blocks; b < c->blocks + c->nblocks; ++b) {
+            if (b->len > 0 && b->dirty) {
+                scan_media(b->data, b->len, b->moff, b->mstate, sigs, dispatch_media, NULL);
+                b->dirty = 0;
+            }
         }
     }
+
+    /* Throw away the start of the stream once no parser needs it, so that
+     * we keep only what is needed for objects still in progress. Wait until
+     * there is at least as much of the first block to throw away as to
+     * keep, so that moving what's left costs no more than receiving it did. */
+    if (c->nblocks > 0 && c->blocks[0].off == 0) {
+        int keep = c->blocks[0].len;
+        if (framed) {
+            if (httpresp_keep(c) < (unsigned int)keep)
+                keep = httpresp_keep(c);
+        } else
+            for (i = 0; i < NMEDIATYPES; ++i)
+                if ((sigs & (1 << i)) && c->blocks[0].moff[i] < keep)
+                    keep = c->blocks[0].moff[i];
+        if (keep >= DISCARD_MIN && keep >= c->blocks[0].len - keep)
+            connection_discard(c, keep);
+    }
 }
@@ -0,0 +1,312 @@
+/*
+ * packetring.c:
+ * Capture packets from a Linux AF_PACKET socket through a memory-mapped
+ * TPACKET_V3 ring, rather than through libpcap.
+ *
+ * The kernel fills fixed-size blocks of the ring with as many frames as will
+ * fit and hands each block to us whole, so we take one poll(2) per block
+ * rather than one system call (or callback setup) per packet. The packets are
+ * presented to the caller through the same callback signature that
+ * pcap_dispatch uses, so the rest of driftnet doesn't notice the difference.
+ * We still use libpcap to compile the filter expression; the resulting BPF
+ * program is attached to the socket directly.
+ *
+ * Copyright (c) 2004 Chris Lightfoot. All rights reserved.
+ * Email: chris@ex-parrot.com; WWW: http://www.ex-parrot.com/~chris/
+ *
+ */
+
+static const char rcsid[] = "$Id$";
+
+#include <sys/types.h>
+
+#include <errno.h>
+#include <pcap.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "driftnet.h"
+
+extern int verbose; /* in driftnet.c */
+
+#ifdef __linux__
+
+#include <poll.h>
+#include <unistd.h>
+
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#include <net/if.h>
+#include <net/if_arp.h>
+#include <linux/filter.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+
+#ifdef TPACKET3_HDRLEN
+
+/* Geometry of the ring. Each block is retired to userspace when it is full
+ * or when RING_BLOCK_TIMEOUT milliseconds have passed since the first frame
+ * was put in it, whichever is sooner. */
+#define RING_BLOCK_SIZE     (1 << 20)
+#define RING_BLOCK_COUNT    64
+#define RING_FRAME_SIZE     2048
+#define RING_BLOCK_TIMEOUT  100
+
+/* struct packetring:
+ * An AF_PACKET socket and the ring mapped from it. */
+struct packetring {
+    int fd;
+    unsigned char *map;
+    size_t maplen;
+    unsigned int nblocks, blocksize, cur;
+};
+
+/* packetring_open INTERFACE PROMISC FILTEREXPR DLT
+ * Open a TPACKET_V3 ring capturing from INTERFACE, optionally in promiscuous
+ * mode, passing only packets which match FILTEREXPR. On success, saves the
+ * data link type of the packets we will return in *DLT and returns the new
+ * ring; on failure prints a message and returns NULL, so that the caller can
+ * fall back to libpcap. */
+struct packetring *packetring_open(const char *interface, const int promisc, const char *filterexpr, int *dlt) {
+    struct packetring *R;
+    struct ifreq ifr = {{{0}}};
+    struct tpacket_req3 req = {0};
+    struct sock_fprog fprog;
+    struct bpf_program filter;
+    struct sockaddr_ll sll = {0};
+    pcap_t *dead;
+    int fd, ifindex, v = TPACKET_V3;
+
+    if (!interface || strlen(interface) >= sizeof ifr.ifr_name) {
+        fprintf(stderr, PROGNAME": packet ring needs a named interface\n");
+        return NULL;
+    }
+
+    /* Protocol 0 means that no packets are queued until we bind below, by
+     * which time the filter is in place. */
+    if ((fd = socket(PF_PACKET, SOCK_RAW, 0)) == -1) {
+        fprintf(stderr, PROGNAME": socket(PF_PACKET): %s\n", strerror(errno));
+        return NULL;
+    }
+
+    strcpy(ifr.ifr_name, interface);
+    if (ioctl(fd, SIOCGIFINDEX, &ifr) == -1) {
+        fprintf(stderr, PROGNAME": %s: %s\n", interface, strerror(errno));
+        goto fail;
+    }
+    ifindex = ifr.ifr_ifindex;
+
+    /* We only understand Ethernet framing here; anything else goes through
+     * libpcap, which knows about cooked headers and so forth. */
+    if (ioctl(fd, SIOCGIFHWADDR, &ifr) == -1) {
+        fprintf(stderr, PROGNAME": %s: %s\n", interface, strerror(errno));
+        goto fail;
+    }
+    if (ifr.ifr_hwaddr.sa_family != ARPHRD_ETHER && ifr.ifr_hwaddr.sa_family != ARPHRD_LOOPBACK) {
+        fprintf(stderr, PROGNAME": %s: packet ring only supports Ethernet interfaces\n", interface);
+        goto fail;
+    }
+    *dlt = DLT_EN10MB;
+
+    /* Compile the filter with libpcap and attach the BPF code to the
+     * socket. */
+    if (!(dead = pcap_open_dead(*dlt, 262144))) {
+        fprintf(stderr, PROGNAME": pcap_open_dead failed\n");
+        goto fail;
+    }
+    if (pcap_compile(dead, &filter, (char*)filterexpr, 1, 0) == -1) {
+        fprintf(stderr, PROGNAME": pcap_compile: %s\n", pcap_geterr(dead));
+        pcap_close(dead);
+        goto fail;
+    }
+    pcap_close(dead);
+
+    /* struct bpf_insn and struct sock_filter have the same layout. */
+    fprog.len = filter.bf_len;
+    fprog.filter = (struct sock_filter*)filter.bf_insns;
+    if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &fprog, sizeof fprog) == -1) {
+        fprintf(stderr, PROGNAME": setsockopt(SO_ATTACH_FILTER): %s\n", strerror(errno));
+        pcap_freecode(&filter);
+        goto fail;
+    }
+    pcap_freecode(&filter);
+
+    if (setsockopt(fd, SOL_PACKET, PACKET_VERSION, &v, sizeof v) == -1) {
+        fprintf(stderr, PROGNAME": setsockopt(PACKET_VERSION): %s\n", strerror(errno));
+        goto fail;
+    }
+
+    req.tp_block_size = RING_BLOCK_SIZE;
+    req.tp_block_nr = RING_BLOCK_COUNT;
+    req.tp_frame_size = RING_FRAME_SIZE;
+    req.tp_frame_nr = (RING_BLOCK_SIZE / RING_FRAME_SIZE) * RING_BLOCK_COUNT;
+    req.tp_retire_blk_tov = RING_BLOCK_TIMEOUT;
+    req.tp_feature_req_word = TP_FT_REQ_FILL_RXHASH;
+    if (setsockopt(fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof req) == -1) {
+        fprintf(stderr, PROGNAME": setsockopt(PACKET_RX_RING): %s\n", strerror(errno));
+        goto fail;
+    }
+
+    alloc_struct(packetring, R);
+    R->fd = fd;
+    R->nblocks = req.tp_block_nr;
+    R->blocksize = req.tp_block_size;
+    R->maplen = (size_t)R->nblocks * R->blocksize;
+    R->map = mmap(NULL, R->maplen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_LOCKED, fd, 0);
+    if (R->map == MAP_FAILED)
+        /* MAP_LOCKED fails if we're over RLIMIT_MEMLOCK; try without. */
+        R->map = mmap(NULL, R->maplen, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (R->map == MAP_FAILED) {
+        fprintf(stderr, PROGNAME": mmap(packet ring): %s\n", strerror(errno));
+        xfree(R);
+        goto fail;
+    }
+
+    if (promisc) {
+        struct packet_mreq mr = {0};
+        mr.mr_ifindex = ifindex;
+        mr.mr_type = PACKET_MR_PROMISC;
+        if (setsockopt(fd, SOL_PACKET, PACKET_ADD_MEMBERSHIP, &mr, sizeof mr) == -1)
+            fprintf(stderr, PROGNAME": %s: can't enter promiscuous mode: %s\n", interface, strerror(errno));
+    }
+
+    sll.sll_family = AF_PACKET;
+    sll.sll_protocol = htons(ETH_P_ALL);
+    sll.sll_ifindex = ifindex;
+    if (bind(fd, (struct sockaddr*)&sll, sizeof sll) == -1) {
+        fprintf(stderr, PROGNAME": bind(%s): %s\n", interface, strerror(errno));
+        munmap(R->map, R->maplen);
+        xfree(R);
+        goto fail;
+    }
+
+    if (verbose)
+        fprintf(stderr, PROGNAME": capturing on %s with a %u x %u byte TPACKET_V3 ring\n", interface, R->nblocks, R->blocksize);
+
+    return R;
+
+fail:
+    close(fd);
+    return NULL;
+}
+
+/* packetring_dispatch RING TIMEOUT CALLBACK USER
+ * Wait up to TIMEOUT milliseconds for the kernel to hand us a block, then pass
+ * each frame in every block which is ready to CALLBACK, as pcap_dispatch
+ * would. We go at most once round the ring, so that the caller gets control
+ * back periodically even if packets are arriving faster than we can process
+ * them. Returns the number of packets processed, or -1 on error. */
+int packetring_dispatch(struct packetring *R, const int timeout, void (*callback)(u_char *, const struct pcap_pkthdr *, const u_char *), u_char *user) {
+    struct tpacket_block_desc *bd;
+    unsigned int nblocks = 0;
+    int n = 0;
+
+    bd = (struct tpacket_block_desc*)(R->map + (size_t)R->cur * R->blocksize);
+    if (!(bd->hdr.bh1.block_status & TP_STATUS_USER)) {
+        struct pollfd pfd;
+        pfd.fd = R->fd;
+        pfd.events = POLLIN | POLLERR;
+        pfd.revents = 0;
+        if (poll(&pfd, 1, timeout) == -1)
+            return errno == EINTR ? 0 : -1;
+    }
+
+    while (nblocks++ < R->nblocks && (bd->hdr.bh1.block_status & TP_STATUS_USER)) {
+        struct tpacket3_hdr *ppd;
+        unsigned int i;
+
+        ppd = (struct tpacket3_hdr*)((unsigned char*)bd + bd->hdr.bh1.offset_to_first_pkt);
+        for (i = 0; i < bd->hdr.bh1.num_pkts; ++i) {
+            struct pcap_pkthdr hdr;
+            hdr.ts.tv_sec = ppd->tp_sec;
+            hdr.ts.tv_usec = ppd->tp_nsec / 1000;
+            hdr.caplen = ppd->tp_snaplen;
+            hdr.len = ppd->tp_len;
+            callback(user, &hdr, (u_char*)ppd + ppd->tp_mac);
+            ppd = (struct tpacket3_hdr*)((unsigned char*)ppd + ppd->tp_next_offset);
+        }
+        n += bd->hdr.bh1.num_pkts;
+
+        /* Give the block back to the kernel and move on to the next one. */
+        __sync_synchronize();
+        bd->hdr.bh1.block_status = TP_STATUS_KERNEL;
+        R->cur = (R->cur + 1) % R->nblocks;
+        bd = (struct tpacket_block_desc*)(R->map + (size_t)R->cur * R->blocksize);
+    }
+
+    return n;
+}
+
+/* packetring_join_fanout RING GROUP
+ * Make RING a member of the PACKET_FANOUT group with the given ID. The kernel
+ * spreads packets across the members of the group by a hash of the flow which
+ * is the same in both directions, reassembling IP fragments first so that
+ * they hash properly. Returns 0 on success or -1 on failure. */
+int packetring_join_fanout(struct packetring *R, const int group) {
+#ifdef PACKET_FANOUT
+    int v;
+    v = (group & 0xffff) | ((PACKET_FANOUT_HASH | PACKET_FANOUT_FLAG_DEFRAG) << 16);
+    if (setsockopt(R->fd, SOL_PACKET, PACKET_FANOUT, &v, sizeof v) == -1) {
+        fprintf(stderr, PROGNAME": setsockopt(PACKET_FANOUT): %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+#else
+    fprintf(stderr, PROGNAME": PACKET_FANOUT is not supported on this system\n");
+    return -1;
+#endif
+}
+
+/* packetring_stats RING RECEIVED DROPPED
+ * Obtain the number of packets received and dropped by the kernel since the
+ * last call. Returns 0 on success or -1 on failure. */
+int packetring_stats(struct packetring *R, unsigned int *received, unsigned int *dropped) {
+    struct tpacket_stats_v3 st;
+    socklen_t l = sizeof st;
+    if (getsockopt(R->fd, SOL_PACKET, PACKET_STATISTICS, &st, &l) == -1)
+        return -1;
+    *received = st.tp_packets;
+    *dropped = st.tp_drops;
+    return 0;
+}
+
+/* packetring_close RING
+ * Unmap and close RING. */
+void packetring_close(struct packetring *R) {
+    munmap(R->map, R->maplen);
+    close(R->fd);
+    xfree(R);
+}
+
+#define HAVE_PACKETRING
+
+#endif /* TPACKET3_HDRLEN */
+#endif /* __linux__ */
+
+#ifndef HAVE_PACKETRING
+
+/* No TPACKET_V3 on this system; callers fall back to libpcap. */
+
+struct packetring *packetring_open(const char *interface, const int promisc, const char *filterexpr, int *dlt) {
+    fprintf(stderr, PROGNAME": packet ring capture is not supported on this system\n");
+    return NULL;
+}
+
+int packetring_dispatch(struct packetring *R, const int timeout, void (*callback)(u_char *, const struct pcap_pkthdr *, const u_char *), u_char *user) {
+    return -1;
+}
+
+int packetring_join_fanout(struct packetring *R, const int group) {
+    return -1;
+}
+
+int packetring_stats(struct packetring *R, unsigned int *received, unsigned int *dropped) {
+    return -1;
+}
+
+void packetring_close(struct packetring *R) {
+}
+
+#endif /* !HAVE_PACKETRING */
@@ -0,0 +1,301 @@
+/*
+ * pattern.c:
+ * Search buffers for fixed strings which are known in advance.
+ *
+ * A pattern is compiled once and may then be searched for any number of times
+ * from any thread. Where the processor supports it, the search compares the
+ * first and last bytes of the pattern against 16 or 32 positions of the
+ * buffer at a time using SSE2 or AVX2, and only looks at the rest of the
+ * pattern where both match; otherwise it uses Boyer-Moore-Horspool. Which to
+ * use is decided at run time. There is also a search for any of a small set
+ * of pairs of bytes, done in the same way.
+ *
+ * Copyright (c) 2004 Chris Lightfoot. All rights reserved.
+ * Email: chris@ex-parrot.com; WWW: http://www.ex-parrot.com/~chris/
+ *
+ */
+
+static const char rcsid[] = "$Id$";
+
+#include <sys/types.h>
+
+#include <pthread.h>
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && !defined(NO_SIMD)
+#   define USE_X86_SIMD
+#   include <immintrin.h>
+#endif
+
+#include "driftnet.h"
+
+/* struct pattern:
+ * A compiled search pattern. */
+struct pattern {
+    unsigned char *needle;
+    size_t len;
+    size_t skip[256];
+    unsigned char *(*find)(const struct pattern *P, const unsigned char *data, const size_t len);
+};
+
+/* find_scalar PATTERN DATA LEN START
+ * Look for PATTERN in DATA, of length LEN, at offsets from START onwards,
+ * using Boyer-Moore-Horspool. */
+static unsigned char *find_scalar(const struct pattern *P, const unsigned char *data, const size_t len, size_t start) {
+    const unsigned char *needle = P->needle;
+    size_t n = P->len, k;
+
+    if (len < n || start > len - n)
+        return NULL;
+    if (n == 1)
+        return memchr(data + start, *needle, len - start);
+
+    for (k = start + n - 1; k < len; k += P->skip[data[k]]) {
+        if (data[k] == needle[n - 1] && memcmp(data + k - (n - 1), needle, n - 1) == 0)
+            return (unsigned char*)(data + k - (n - 1));
+    }
+
+    return NULL;
+}
+
+static unsigned char *find_generic(const struct pattern *P, const unsigned char *data, const size_t len) {
+    return find_scalar(P, data, len, 0);
+}
+
+/* pair_scalar DATA LEN PAIRS NPAIRS
+ * Return a pointer to the first place in DATA, of length LEN, where one of
+ * the NPAIRS PAIRS occurs, or where the first byte of one is the last byte of
+ * DATA; or NULL if there is none. */
+static unsigned char *pair_scalar(const unsigned char *data, const size_t len, const struct bytepair *pairs, const int npairs) {
+    const unsigned char *p, *end = data + len;
+    int k;
+
+    for (p = data; p < end; ++p)
+        for (k = 0; k < npairs; ++k)
+            if (*p == pairs[k].first && (p + 1 == end || (p[1] & pairs[k].mask) == pairs[k].second))
+                return (unsigned char*)p;
+    return NULL;
+}
+
+#ifdef USE_X86_SIMD
+
+/* find_sse2, find_avx2 PATTERN DATA LEN
+ * Look for PATTERN in DATA, of length LEN, a block of positions at a time,
+ * finishing off with find_scalar. */
+__attribute__((target("sse2")))
+static unsigned char *find_sse2(const struct pattern *P, const unsigned char *data, const size_t len) {
+    const unsigned char *needle = P->needle;
+    size_t n = P->len, i = 0;
+    __m128i first, last;
+
+    first = _mm_set1_epi8((char)needle[0]);
+    last = _mm_set1_epi8((char)needle[n - 1]);
+
+    for (; len >= n - 1 + 16 && i <= len - (n - 1) - 16; i += 16) {
+        __m128i a, b;
+        unsigned int mask;
+
+        a = _mm_loadu_si128((const __m128i*)(data + i));
+        b = _mm_loadu_si128((const __m128i*)(data + i + n - 1));
+        mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+        while (mask) {
+            int j = __builtin_ctz(mask);
+            if (n <= 2 || memcmp(data + i + j + 1, needle + 1, n - 2) == 0)
+                return (unsigned char*)(data + i + j);
+            mask &= mask - 1;
+        }
+    }
+
+    return find_scalar(P, data, len, i);
+}
+
+__attribute__((target("avx2")))
+static unsigned char *find_avx2(const struct pattern *P, const unsigned char *data, const size_t len) {
+    const unsigned char *needle = P->needle;
+    size_t n = P->len, i = 0;
+    __m256i first, last;
+
+    first = _mm256_set1_epi8((char)needle[0]);
+    last = _mm256_set1_epi8((char)needle[n - 1]);
+
+    for (; len >= n - 1 + 32 && i <= len - (n - 1) - 32; i += 32) {
+        __m256i a, b;
+        unsigned int mask;
+
+        a = _mm256_loadu_si256((const __m256i*)(data + i));
+        b = _mm256_loadu_si256((const __m256i*)(data + i + n - 1));
+        mask = (unsigned int)_mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last)));
+        while (mask) {
+            int j = __builtin_ctz(mask);
+            if (n <= 2 || memcmp(data + i + j + 1, needle + 1, n - 2) == 0)
+                return (unsigned char*)(data + i + j);
+            mask &= mask - 1;
+        }
+    }
+
+    return find_scalar(P, data, len, i);
+}
+
+/* pair_sse2 DATA LEN PAIRS NPAIRS
+ * As pair_scalar, a block of positions at a time, comparing the first byte
+ * of each pair against one block and the masked second byte against the
+ * block one byte further on. PAIRS has at most MAX_PAIRS entries. */
+__attribute__((target("sse2")))
+static unsigned char *pair_sse2(const unsigned char *data, const size_t len, const struct bytepair *pairs, const int npairs) {
+    __m128i f[MAX_PAIRS], s[MAX_PAIRS], m[MAX_PAIRS];
+    size_t i = 0;
+    int k;
+
+    for (k = 0; k < npairs; ++k) {
+        f[k] = _mm_set1_epi8((char)pairs[k].first);
+        s[k] = _mm_set1_epi8((char)pairs[k].second);
+        m[k] = _mm_set1_epi8((char)pairs[k].mask);
+    }
+
+    for (; i + 17 <= len; i += 16) {
+        __m128i a, b, hit;
+        unsigned int mask;
+
+        a = _mm_loadu_si128((const __m128i*)(data + i));
+        b = _mm_loadu_si128((const __m128i*)(data + i + 1));
+        hit = _mm_and_si128(_mm_cmpeq_epi8(a, f[0]), _mm_cmpeq_epi8(_mm_and_si128(b, m[0]), s[0]));
+        for (k = 1; k < npairs; ++k)
+            hit = _mm_or_si128(hit, _mm_and_si128(_mm_cmpeq_epi8(a, f[k]), _mm_cmpeq_epi8(_mm_and_si128(b, m[k]), s[k])));
+        if ((mask = _mm_movemask_epi8(hit)))
+            return (unsigned char*)(data + i + __builtin_ctz(mask));
+    }
+
+    return pair_scalar(data + i, len - i, pairs, npairs);
+}
+
+/* pair_avx2 DATA LEN PAIRS NPAIRS
+ * As pair_sse2, but rather than comparing against each pair in turn, looks
+ * up the two halves of each byte of the two blocks in tables which give the
+ * set of pairs they are consistent with, so that the cost doesn't depend on
+ * the number of pairs. This is exact, because a condition on a masked byte
+ * is a condition on each half of it separately. */
+__attribute__((target("avx2")))
+static unsigned char *pair_avx2(const unsigned char *data, const size_t len, const struct bytepair *pairs, const int npairs) {
+    unsigned char tab[4][16] = {{0}};
+    __m256i lo1, hi1, lo2, hi2, nibble, zero;
+    size_t i = 0;
+    int k, n;
+
+    /* We are called again after each candidate, so this must be quick. */
+    for (k = 0; k < npairs; ++k) {
+        tab[0][pairs[k].first & 0xf] |= 1 << k;
+        tab[1][pairs[k].first >> 4] |= 1 << k;
+        if (pairs[k].mask == 0xff) {
+            tab[2][pairs[k].second & 0xf] |= 1 << k;
+            tab[3][pairs[k].second >> 4] |= 1 << k;
+        } else for (n = 0; n < 16; ++n) {
+            if ((n & pairs[k].mask & 0xf) == (pairs[k].second & 0xf))
+                tab[2][n] |= 1 << k;
+            if ((n & (pairs[k].mask >> 4)) == (pairs[k].second >> 4))
+                tab[3][n] |= 1 << k;
+        }
+    }
+    lo1 = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)tab[0]));
+    hi1 = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)tab[1]));
+    lo2 = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)tab[2]));
+    hi2 = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)tab[3]));
+    nibble = _mm256_set1_epi8(0xf);
+    zero = _mm256_setzero_si256();
+
+    for (; i + 33 <= len; i += 32) {
+        __m256i a, b, hit;
+        unsigned int mask;
+
+        a = _mm256_loadu_si256((const __m256i*)(data + i));
+        b = _mm256_loadu_si256((const __m256i*)(data + i + 1));
+        hit = _mm256_and_si256(
+                _mm256_and_si256(
+                    _mm256_shuffle_epi8(lo1, _mm256_and_si256(a, nibble)),
+                    _mm256_shuffle_epi8(hi1, _mm256_and_si256(_mm256_srli_epi16(a, 4), nibble))),
+                _mm256_and_si256(
+                    _mm256_shuffle_epi8(lo2, _mm256_and_si256(b, nibble)),
+                    _mm256_shuffle_epi8(hi2, _mm256_and_si256(_mm256_srli_epi16(b, 4), nibble))));
+        if ((mask = ~(unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(hit, zero))))
+            return (unsigned char*)(data + i + __builtin_ctz(mask));
+    }
+
+    return pair_scalar(data + i, len - i, pairs, npairs);
+}
+
+#endif /* USE_X86_SIMD */
+
+/* The search function to use for patterns, chosen according to what the
+ * processor can do. */
+static unsigned char *(*best_find)(const struct pattern *P, const unsigned char *data, const size_t len) = find_generic;
+static unsigned char *(*best_pair)(const unsigned char *data, const size_t len, const struct bytepair *pairs, const int npairs) = pair_scalar;
+static pthread_once_t best_find_once = PTHREAD_ONCE_INIT;
+
+static void choose_find(void) {
+#ifdef USE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        best_find = find_avx2;
+        best_pair = pair_avx2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        best_find = find_sse2;
+        best_pair = pair_sse2;
+    }
+#endif
+}
+
+/* pattern_new NEEDLE LEN
+ * Compile a pattern which matches the LEN bytes at NEEDLE. */
+pattern pattern_new(const unsigned char *needle, const size_t len) {
+    pattern P;
+    size_t k;
+
+    pthread_once(&best_find_once, choose_find);
+
+    alloc_struct(pattern, P);
+    P->needle = xmalloc(len ? len : 1);
+    memcpy(P->needle, needle, len);
+    P->len = len;
+
+    for (k = 0; k < 256; ++k)
+        P->skip[k] = len;
+    for (k = 0; k + 1 < len; ++k)
+        P->skip[needle[k]] = len - k - 1;
+
+    P->find = len ? best_find : find_generic;
+
+    return P;
+}
+
+/* pattern_delete PATTERN
+ * Free PATTERN. */
+void pattern_delete(pattern P) {
+    xfree(P->needle);
+    xfree(P);
+}
+
+/* pattern_find PATTERN DATA LEN
+ * Return a pointer to the first occurrence of PATTERN in DATA, of length LEN,
+ * or NULL if there is none. */
+unsigned char *pattern_find(const pattern P, const unsigned char *data, const size_t len) {
+    if (P->len == 0)
+        return (unsigned char*)data;
+    return P->find(P, data, len);
+}
+
+/* pattern_find_generic PATTERN DATA LEN
+ * As pattern_find, but never using the vector search functions. */
+unsigned char *pattern_find_generic(const pattern P, const unsigned char *data, const size_t len) {
+    if (P->len == 0)
+        return (unsigned char*)data;
+    return find_generic(P, data, len);
+}
+
+/* memchr_pair DATA LEN PAIRS NPAIRS
+ * Return a pointer to the first place in DATA, of length LEN, where one of
+ * the NPAIRS (at most MAX_PAIRS) PAIRS occurs, or where the first byte of one
+ * is the last byte of DATA, so that we can't tell; or NULL if there is
+ * none. */
+unsigned char *memchr_pair(const unsigned char *data, const size_t len, const struct bytepair *pairs, const int npairs) {
+    pthread_once(&best_find_once, choose_find);
+    return best_pair(data, len, pairs, npairs);
+}
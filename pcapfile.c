@@ -0,0 +1,949 @@
+/*
+ * pcapfile.c:
+ * Read packets from pcap and pcapng dump files without going through
+ * libpcap.
+ *
+ * Ordinary files are mapped into memory and read sequentially, so that
+ * packets are handed to the caller straight out of the page cache, with no
+ * copying and no system call per packet; we tell the kernel that we're
+ * reading sequentially, and throw away pages once we've finished with them so
+ * that very large files don't fill up memory. Named pipes and the like (for
+ * instance, a pipe from Kismet) can't be mapped, so we read those through a
+ * large buffer instead.
+ *
+ * Copyright (c) 2004 Chris Lightfoot. All rights reserved.
+ * Email: chris@ex-parrot.com; WWW: http://www.ex-parrot.com/~chris/
+ *
+ */
+
+static const char rcsid[] = "$Id$";
+
+#include <sys/types.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pcap.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <netinet/in.h>
+#include <netinet/in_systm.h>
+#include <netinet/ip.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "driftnet.h"
+
+extern int verbose; /* in driftnet.c */
+
+/* Size of the buffer used for files which can't be mapped; it grows if a
+ * single record is bigger than this. */
+#define STREAM_BUFSIZE      (4 * 1024 * 1024)
+
+/* How much of a mapped file we read before telling the kernel that it can
+ * discard the pages behind us. */
+#define RELEASE_CHUNK       (64 * 1024 * 1024)
+
+/* Largest packet record we believe in. */
+#define MAX_RECORD          (16 * 1024 * 1024)
+
+/* Magic numbers. */
+#define PCAP_MAGIC          0xa1b2c3d4  /* microsecond timestamps */
+#define PCAP_MAGIC_NSEC     0xa1b23c4d  /* nanosecond timestamps */
+#define PCAPNG_SHB          0x0a0d0d0a  /* section header block type */
+#define PCAPNG_BOM          0x1a2b3c4d  /* byte-order magic */
+#define PCAPNG_BOM_SWAPPED  0x4d3c2b1a
+
+/* pcapng block types we understand. */
+#define PCAPNG_IDB          1   /* interface description */
+#define PCAPNG_PB           2   /* (obsolete) packet block */
+#define PCAPNG_SPB          3   /* simple packet block */
+#define PCAPNG_EPB          6   /* enhanced packet block */
+
+/* struct pcapng_if:
+ * What we need to know about an interface in a pcapng file. */
+struct pcapng_if {
+    unsigned int snaplen;
+    uint64_t units;         /* timestamp units per second */
+    int64_t offset;         /* seconds to add to timestamps */
+};
+
+/* struct pcapfile:
+ * An open dump file. */
+struct pcapfile {
+    int fd;
+    /* Data from the file: either the whole thing mapped into memory, or a
+     * buffer containing the part we've read so far. pos is the offset of the
+     * next record in data, and len the amount of valid data. */
+    unsigned char *data;
+    size_t len, pos;
+    int mapped;
+    size_t bufsize, released;
+    int eof;
+
+    enum { f_pcap, f_pcapng } format;
+    int swapped;            /* file byte order differs from ours */
+    int nsec;               /* pcap: nanosecond timestamps */
+    unsigned int snaplen;   /* pcap: snapshot length */
+    int linktype;           /* DLT_ value for all packets in the file */
+
+    /* pcapng: interfaces in the current section. */
+    struct pcapng_if *ifs;
+    unsigned int nifs;
+
+    /* We stop reading records once we get to limit. */
+    size_t limit;
+    /* Nonzero if this is a cursor on the data of another pcapfile, rather
+     * than a file we opened ourselves. */
+    int cursor;
+
+    /* If the file is being shared among several workers, the state of that. */
+    struct pcapsplit *split;
+};
+
+/* get16, get32, get64 FILE PTR
+ * Fetch a 16-, 32- or 64-bit quantity in the byte order of FILE. */
+static uint16_t get16(const struct pcapfile *F, const unsigned char *p) {
+    uint16_t v;
+    memcpy(&v, p, sizeof v);
+    return F->swapped ? (uint16_t)((v >> 8) | (v << 8)) : v;
+}
+
+static uint32_t get32(const struct pcapfile *F, const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof v);
+    return F->swapped ? ((v >> 24) | ((v >> 8) & 0xff00) | ((v << 8) & 0xff0000) | (v << 24)) : v;
+}
+
+static uint64_t get64(const struct pcapfile *F, const unsigned char *p) {
+    uint64_t v;
+    int i;
+    memcpy(&v, p, sizeof v);
+    if (F->swapped) {
+        uint64_t w = 0;
+        for (i = 0; i < 8; ++i, v >>= 8)
+            w = (w << 8) | (v & 0xff);
+        v = w;
+    }
+    return v;
+}
+
+/* linktype_to_dlt LINKTYPE
+ * Map a LINKTYPE_ value, as stored in files, to the DLT_ value used by
+ * get_link_level_hdr_length. They're the same except for a few types whose
+ * DLT_ values differ between platforms. */
+static int linktype_to_dlt(const int linktype) {
+    switch (linktype) {
+#ifdef DLT_ATM_RFC1483
+        case 100: return DLT_ATM_RFC1483;
+#endif
+        case 101: return DLT_RAW;
+        case 102: return DLT_SLIP_BSDOS;
+        case 103: return DLT_PPP_BSDOS;
+#ifdef DLT_ATM_CLIP
+        case 106: return DLT_ATM_CLIP;
+#endif
+#ifdef DLT_PPP_SERIAL
+        case 50:  return DLT_PPP_SERIAL;
+#endif
+        default:  return linktype;
+    }
+}
+
+/* need FILE COUNT
+ * Make sure that there are at least COUNT bytes of data available at the
+ * current position. For a mapped file that's just a check; otherwise we may
+ * need to read more data, moving what we have to the start of the buffer
+ * (which invalidates any pointers into it). Returns nonzero if the data are
+ * available. */
+static int need(struct pcapfile *F, const size_t n) {
+    if (F->len - F->pos >= n)
+        return 1;
+    else if (F->mapped || F->eof)
+        return 0;
+
+    if (F->pos > 0) {
+        memmove(F->data, F->data + F->pos, F->len - F->pos);
+        F->len -= F->pos;
+        F->pos = 0;
+    }
+    if (n > F->bufsize) {
+        F->data = xrealloc(F->data, n);
+        F->bufsize = n;
+    }
+
+    while (F->len < n) {
+        ssize_t r;
+        r = read(F->fd, F->data + F->len, F->bufsize - F->len);
+        if (r == -1 && errno == EINTR)
+            continue;
+        else if (r == -1) {
+            fprintf(stderr, PROGNAME": read dump file: %s\n", strerror(errno));
+            F->eof = 1;
+            return 0;
+        } else if (r == 0) {
+            F->eof = 1;
+            return 0;
+        }
+        F->len += r;
+    }
+    return 1;
+}
+
+/* release FILE
+ * Tell the kernel that we won't look at the mapped data behind the current
+ * position again. */
+static void release(struct pcapfile *F) {
+    if (F->mapped && !F->cursor && !F->split && F->pos - F->released >= RELEASE_CHUNK) {
+        size_t end;
+        end = F->pos & ~((size_t)getpagesize() - 1);
+        madvise(F->data + F->released, end - F->released, MADV_DONTNEED);
+        F->released = end;
+    }
+}
+
+/* pcapng_section FILE
+ * Start a new section at the section header block at the current position.
+ * Returns nonzero on success. */
+static int pcapng_section(struct pcapfile *F) {
+    uint32_t bom, blen;
+
+    if (!need(F, 12))
+        return 0;
+    memcpy(&bom, F->data + F->pos + 8, sizeof bom);
+    if (bom == PCAPNG_BOM)
+        F->swapped = 0;
+    else if (bom == PCAPNG_BOM_SWAPPED)
+        F->swapped = 1;
+    else {
+        fprintf(stderr, PROGNAME": pcapng file has bad byte-order magic\n");
+        return 0;
+    }
+
+    blen = get32(F, F->data + F->pos + 4);
+    if (blen < 28 || blen % 4 || !need(F, blen))
+        return 0;
+    F->pos += blen;
+
+    /* Interface IDs are local to the section. */
+    F->nifs = 0;
+    return 1;
+}
+
+/* pcapng_interface FILE BLOCK LENGTH
+ * Record the interface described by the IDB BLOCK of the given LENGTH.
+ * Returns nonzero on success. */
+static int pcapng_interface(struct pcapfile *F, const unsigned char *b, const uint32_t blen) {
+    struct pcapng_if *I;
+    const unsigned char *o, *end;
+    int linktype;
+
+    if (blen < 20)
+        return 0;
+
+    /* libpcap insists that all the interfaces in a file have the same link
+     * type, and so do we. */
+    linktype = linktype_to_dlt(get16(F, b + 8));
+    if (F->linktype == -1)
+        F->linktype = linktype;
+    else if (linktype != F->linktype) {
+        fprintf(stderr, PROGNAME": pcapng file has interfaces with different link types\n");
+        return 0;
+    }
+
+    F->ifs = xrealloc(F->ifs, (F->nifs + 1) * sizeof *F->ifs);
+    I = F->ifs + F->nifs++;
+    I->snaplen = get32(F, b + 12);
+    I->units = 1000000;
+    I->offset = 0;
+
+    /* Look through the options for the timestamp resolution and offset. */
+    for (o = b + 16, end = b + blen - 4; o + 4 <= end; ) {
+        unsigned int code, olen;
+        code = get16(F, o);
+        olen = get16(F, o + 2);
+        if (code == 0 || o + 4 + olen > end)
+            break;
+        if (code == 9 && olen >= 1) {
+            /* if_tsresol: a negative power of ten or, if the top bit is set,
+             * of two. */
+            int i, e = o[4] & 0x7f;
+            I->units = 1;
+            if (o[4] & 0x80)
+                I->units = e < 64 ? (uint64_t)1 << e : 0;
+            else
+                for (i = 0; i < e && i < 20; ++i)
+                    I->units *= 10;
+            if (I->units == 0 || e >= 20)
+                I->units = 1000000;
+        } else if (code == 14 && olen >= 8) {
+            /* if_tsoffset */
+            I->offset = (int64_t)get64(F, o + 4);
+        }
+        o += 4 + ((olen + 3) & ~3);
+    }
+
+    return 1;
+}
+
+/* pcapfile_open NAME FALLBACK
+ * Open the pcap or pcapng dump file NAME ("-" means standard input). Returns
+ * the new file, or NULL if it can't be opened or isn't in a format we
+ * understand. In the latter case, if FALLBACK is not NULL, *FALLBACK is set
+ * nonzero if the caller may try libpcap instead, which it can't if we have
+ * already read some of a pipe; otherwise a message has been printed. */
+struct pcapfile *pcapfile_open(const char *name, int *fallback) {
+    struct pcapfile *F;
+    struct stat st;
+    uint32_t magic;
+
+    if (fallback)
+        *fallback = 0;
+    alloc_struct(pcapfile, F);
+    F->linktype = -1;
+    F->limit = (size_t)-1;
+
+    if (strcmp(name, "-") == 0)
+        F->fd = 0;
+    else if ((F->fd = open(name, O_RDONLY)) == -1) {
+        fprintf(stderr, PROGNAME": %s: %s\n", name, strerror(errno));
+        xfree(F);
+        return NULL;
+    }
+
+    if (fstat(F->fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        F->data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, F->fd, 0);
+        if (F->data != MAP_FAILED) {
+            F->mapped = 1;
+            F->len = st.st_size;
+            madvise(F->data, F->len, MADV_SEQUENTIAL);
+        }
+    }
+    if (!F->mapped) {
+        F->data = xmalloc(F->bufsize = STREAM_BUFSIZE);
+        F->len = 0;
+    }
+
+    if (!need(F, 4))
+        goto unknown;
+    memcpy(&magic, F->data, sizeof magic);
+
+    if (magic == PCAPNG_SHB) {
+        F->format = f_pcapng;
+        if (!pcapng_section(F))
+            goto unknown;
+        /* The link type comes from the first interface description block,
+         * which must appear before any packets. */
+        while (F->linktype == -1) {
+            uint32_t type, blen;
+            if (!need(F, 12))
+                goto unknown;
+            type = get32(F, F->data + F->pos);
+            blen = get32(F, F->data + F->pos + 4);
+            if (blen < 12 || blen % 4 || blen > MAX_RECORD || !need(F, blen))
+                goto unknown;
+            if (type == PCAPNG_IDB) {
+                if (!pcapng_interface(F, F->data + F->pos, blen))
+                    goto unknown;
+            } else if (type == PCAPNG_EPB || type == PCAPNG_PB || type == PCAPNG_SPB || type == PCAPNG_SHB)
+                goto unknown;
+            F->pos += blen;
+        }
+    } else {
+        /* Classic pcap, in either byte order. */
+        F->format = f_pcap;
+        F->swapped = (magic != PCAP_MAGIC && magic != PCAP_MAGIC_NSEC);
+        magic = get32(F, F->data);
+        if (magic == PCAP_MAGIC_NSEC)
+            F->nsec = 1;
+        else if (magic != PCAP_MAGIC)
+            goto unknown;
+        if (!need(F, 24))
+            goto unknown;
+        F->snaplen = get32(F, F->data + 16);
+        /* The top bits of the link type field may hold FCS information. */
+        F->linktype = linktype_to_dlt(get32(F, F->data + 20) & 0x0fffffff);
+        F->pos = 24;
+    }
+
+    if (verbose)
+        fprintf(stderr, PROGNAME": reading %s file %s%s\n", F->format == f_pcap ? "pcap" : "pcapng", name, F->mapped ? " (mapped)" : "");
+
+    return F;
+
+unknown:
+    /* libpcap must start from the beginning of the file. */
+    if (F->mapped || F->len == 0 || lseek(F->fd, 0, SEEK_SET) == 0) {
+        if (fallback)
+            *fallback = 1;
+        if (verbose)
+            fprintf(stderr, PROGNAME": %s: not a pcap or pcapng file we can read ourselves\n", name);
+    } else
+        fprintf(stderr, PROGNAME": %s: not a pcap or pcapng file\n", name);
+    pcapfile_close(F);
+    return NULL;
+}
+
+/* pcapfile_datalink FILE
+ * Return the DLT_ link type of the packets in FILE. */
+int pcapfile_datalink(struct pcapfile *F) {
+    return F->linktype;
+}
+
+/* pcapfile_dispatch FILE COUNT CALLBACK USER
+ * Pass up to COUNT packets (or all of them, if COUNT is -1) from FILE to
+ * CALLBACK, as pcap_dispatch would. The packet data passed to CALLBACK point
+ * straight into the mapped file or our buffer, and are only valid until it
+ * returns. Returns the number of packets processed, which is 0 at the end of
+ * the file. */
+int pcapfile_dispatch(struct pcapfile *F, const int cnt, void (*callback)(u_char *, const struct pcap_pkthdr *, const u_char *), u_char *user) {
+    int n = 0;
+
+    while ((cnt < 0 || n < cnt) && F->pos < F->limit) {
+        struct pcap_pkthdr hdr;
+        const unsigned char *b, *pkt;
+        uint32_t blen;
+
+        if (F->format == f_pcap) {
+            if (!need(F, 16))
+                break;
+            b = F->data + F->pos;
+            hdr.caplen = get32(F, b + 8);
+            hdr.len = get32(F, b + 12);
+            if (hdr.caplen > MAX_RECORD) {
+                fprintf(stderr, PROGNAME": bogus record in dump file (%u bytes)\n", hdr.caplen);
+                F->pos = F->len;
+                F->eof = 1;
+                break;
+            }
+            if (!need(F, 16 + hdr.caplen))
+                break;
+            b = F->data + F->pos;
+            hdr.ts.tv_sec = get32(F, b);
+            hdr.ts.tv_usec = F->nsec ? get32(F, b + 4) / 1000 : get32(F, b + 4);
+            pkt = b + 16;
+            F->pos += 16 + hdr.caplen;
+        } else {
+            uint32_t type;
+            struct pcapng_if *I;
+            uint64_t ts;
+            unsigned int ifid;
+
+            if (!need(F, 12))
+                break;
+            if (get32(F, F->data + F->pos) == PCAPNG_SHB) {
+                if (!pcapng_section(F))
+                    break;
+                continue;
+            }
+            blen = get32(F, F->data + F->pos + 4);
+            if (blen < 12 || blen % 4 || blen > MAX_RECORD) {
+                fprintf(stderr, PROGNAME": bogus block in dump file (%u bytes)\n", blen);
+                F->pos = F->len;
+                F->eof = 1;
+                break;
+            }
+            if (!need(F, blen))
+                break;
+            b = F->data + F->pos;
+            type = get32(F, b);
+            F->pos += blen;
+
+            switch (type) {
+                case PCAPNG_IDB:
+                    if (!pcapng_interface(F, b, blen)) {
+                        F->pos = F->len;
+                        F->eof = 1;
+                        return n;
+                    }
+                    continue;
+
+                case PCAPNG_EPB:
+                case PCAPNG_PB:
+                    if (blen < 32)
+                        continue;
+                    ifid = type == PCAPNG_EPB ? get32(F, b + 8) : get16(F, b + 8);
+                    ts = ((uint64_t)get32(F, b + 12) << 32) | get32(F, b + 16);
+                    hdr.caplen = get32(F, b + 20);
+                    hdr.len = get32(F, b + 24);
+                    if (hdr.caplen > blen - 32)
+                        hdr.caplen = blen - 32;
+                    pkt = b + 28;
+                    break;
+
+                case PCAPNG_SPB:
+                    if (blen < 16)
+                        continue;
+                    ifid = 0;
+                    ts = 0;
+                    hdr.len = get32(F, b + 8);
+                    hdr.caplen = blen - 16;
+                    if (hdr.caplen > hdr.len)
+                        hdr.caplen = hdr.len;
+                    pkt = b + 12;
+                    break;
+
+                default:
+                    /* Name resolution, statistics, etc. */
+                    continue;
+            }
+
+            if (ifid >= F->nifs)
+                continue;
+            I = F->ifs + ifid;
+            if (I->snaplen && hdr.caplen > I->snaplen)
+                hdr.caplen = I->snaplen;
+            if (type == PCAPNG_SPB) {
+                hdr.ts.tv_sec = 0;
+                hdr.ts.tv_usec = 0;
+            } else {
+                hdr.ts.tv_sec = (time_t)(ts / I->units + I->offset);
+                hdr.ts.tv_usec = (suseconds_t)((ts % I->units) * 1000000 / I->units);
+            }
+        }
+
+        callback(user, &hdr, pkt);
+        ++n;
+
+        release(F);
+    }
+
+    return n;
+}
+
+/* timespan_collect SPAN HEADER PACKET
+ * Callback which records the first and last timestamps it sees. */
+static void timespan_collect(u_char *user, const struct pcap_pkthdr *hdr, const u_char *pkt) {
+    time_t *span = (time_t*)user;
+    if (!span[0])
+        span[0] = hdr->ts.tv_sec;
+    span[1] = hdr->ts.tv_sec;
+}
+
+/* pcapfile_timespan FILE FIRST LAST
+ * Save in *FIRST and *LAST the timestamps of the first and last packets in
+ * FILE, which must be mapped, without disturbing the position from which we
+ * read packets. Returns 0 on success or -1 if the file isn't mapped or has no
+ * packets in it. */
+int pcapfile_timespan(struct pcapfile *F, time_t *first, time_t *last) {
+    struct pcapfile cur;
+    time_t span[2] = {0, 0};
+
+    if (!F->mapped)
+        return -1;
+
+    cur = *F;
+    cur.cursor = 1;
+    if (F->nifs) {
+        cur.ifs = xmalloc(F->nifs * sizeof *F->ifs);
+        memcpy(cur.ifs, F->ifs, F->nifs * sizeof *F->ifs);
+    } else
+        cur.ifs = NULL;
+    pcapfile_dispatch(&cur, -1, timespan_collect, (u_char*)span);
+    xfree(cur.ifs);
+
+    if (!span[0])
+        return -1;
+    *first = span[0];
+    *last = span[1];
+    return 0;
+}
+
+/*
+ * Sharing a file among several workers.
+ *
+ * The file is divided into chunks by byte offset. Reader threads each take a
+ * chunk, find the first record in it, and sort its packets into a list for
+ * each worker by a hash of their addresses and ports, so that both halves of
+ * a connection always go to the same worker. The workers take the chunks in
+ * order, so each sees its packets in the order they appear in the file. The
+ * packets stay where they are in the mapped file; the lists only point at
+ * them.
+ *
+ * Finding the first record in an arbitrary part of a pcap file is guesswork,
+ * so before a chunk is handed to the workers we check that it starts where
+ * the one before it finished, and if not read it again from there. A pcapng
+ * block can't be understood without the interface descriptions before it, so
+ * for those files a single reader takes the chunks in turn.
+ */
+
+/* Size of the chunks. */
+#define SPLIT_CHUNK         (32 * 1024 * 1024)
+
+/* Number of records which must follow a plausible record header before we
+ * believe that we have found the start of one. */
+#define SPLIT_RESYNC        8
+
+/* struct splitpkt:
+ * A packet in a worker's list, with the latest timestamp of the packets
+ * before it in its chunk. */
+struct splitpkt {
+    struct pcap_pkthdr hdr;
+    const u_char *pkt;
+    time_t clock;
+};
+
+struct splitlist {
+    struct splitpkt *p;
+    size_t n, alloc;
+};
+
+/* struct splitchunk:
+ * A chunk of the file, occupying one of the slots in the window of chunks
+ * being read or processed. */
+struct splitchunk {
+    size_t num;
+    size_t start, end;      /* first record, and end of chunk */
+    size_t next;            /* first record after those in the chunk */
+    time_t base, maxts;     /* time before the chunk; latest timestamp in it */
+    struct splitlist *lists;
+    int pending;            /* workers which haven't finished with it */
+};
+
+/* struct splitreader:
+ * A reader thread, with its own cursor on the file. */
+struct splitreader {
+    pthread_t thread;
+    struct pcapfile *F;
+    struct pcapfile cur;
+    struct splitchunk *C;
+    time_t clock;
+};
+
+/* struct splitpos:
+ * How far a worker has got. */
+struct splitpos {
+    size_t chunk, i;
+    int have;
+};
+
+struct pcapsplit {
+    pthread_mutex_t mtx;
+    pthread_cond_t cond;
+    int nworkers, nreaders, pkt_offset, stop;
+    struct splitreader *readers;
+    size_t first, nchunks;
+    /* Chunks given to readers, checked and made available to workers, and
+     * finished with by every worker; they are checked and retired in order. */
+    size_t taken, validated, retired;
+    /* Where the last chunk checked finished, and the latest timestamp in all
+     * chunks checked so far. */
+    size_t next;
+    time_t clock;
+    struct splitchunk *window;
+    size_t nwindow;
+    struct splitpos *wpos;
+};
+
+static void split_unlock(void *v) {
+    pthread_mutex_unlock(&((struct pcapsplit*)v)->mtx);
+}
+
+/* split_hash SPLIT HEADER PACKET
+ * Return the worker which should handle PACKET. The hash is symmetric in the
+ * source and destination, so that both directions go to the same place. */
+static int split_hash(const struct pcapsplit *S, const struct pcap_pkthdr *hdr, const u_char *pkt) {
+    struct ip ip;
+    uint16_t ports[2];
+    uint32_t h;
+
+    if (hdr->caplen < S->pkt_offset + sizeof ip)
+        return 0;
+    memcpy(&ip, pkt + S->pkt_offset, sizeof ip);
+    h = ip.ip_src.s_addr ^ ip.ip_dst.s_addr;
+    if (hdr->caplen >= S->pkt_offset + (ip.ip_hl << 2) + sizeof ports) {
+        memcpy(ports, pkt + S->pkt_offset + (ip.ip_hl << 2), sizeof ports);
+        h ^= (uint32_t)(ports[0] ^ ports[1]) << 7;
+    }
+    h *= 0x9e3779b1;
+    h ^= h >> 15;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    return h % S->nworkers;
+}
+
+/* split_collect READER HEADER PACKET
+ * Callback which puts a packet on the appropriate worker's list. */
+static void split_collect(u_char *user, const struct pcap_pkthdr *hdr, const u_char *pkt) {
+    struct splitreader *r = (struct splitreader*)user;
+    struct splitlist *L;
+    struct splitpkt *P;
+
+    L = r->C->lists + split_hash(r->F->split, hdr, pkt);
+    if (L->n == L->alloc) {
+        L->alloc = L->alloc ? L->alloc * 2 : 256;
+        L->p = xrealloc(L->p, L->alloc * sizeof *L->p);
+    }
+    P = L->p + L->n++;
+    P->hdr = *hdr;
+    P->pkt = pkt;
+    P->clock = r->clock;
+    if (hdr->ts.tv_sec > r->clock)
+        r->clock = hdr->ts.tv_sec;
+}
+
+/* plausible_record FILE OFFSET NEXT
+ * Could a pcap record start at OFFSET in FILE? If so, save the offset of the
+ * record after it in *NEXT. */
+static int plausible_record(const struct pcapfile *F, const size_t off, size_t *next) {
+    const unsigned char *b;
+    uint32_t frac, caplen, len;
+
+    if (off + 16 > F->len)
+        return 0;
+    b = F->data + off;
+    frac = get32(F, b + 4);
+    caplen = get32(F, b + 8);
+    len = get32(F, b + 12);
+    if (frac >= (F->nsec ? 1000000000 : 1000000)
+        || caplen > len || len > MAX_RECORD
+        || (F->snaplen && caplen > F->snaplen)
+        || off + 16 + caplen > F->len)
+        return 0;
+    *next = off + 16 + caplen;
+    return 1;
+}
+
+/* find_record FILE START END
+ * Return the offset of what looks like the first pcap record between START
+ * and END in FILE, or END if there isn't one. */
+static size_t find_record(const struct pcapfile *F, const size_t start, const size_t end) {
+    size_t off;
+    for (off = start; off < end; ++off) {
+        size_t q = off;
+        int i;
+        for (i = 0; i < SPLIT_RESYNC && q < F->len; ++i)
+            if (!plausible_record(F, q, &q))
+                break;
+        if (i == SPLIT_RESYNC || q == F->len)
+            return off;
+    }
+    return end;
+}
+
+/* split_read READER CHUNK START
+ * Read the records in CHUNK, starting from START. */
+static void split_read(struct splitreader *r, struct splitchunk *C, const size_t start) {
+    int i;
+
+    for (i = 0; i < r->F->split->nworkers; ++i)
+        C->lists[i].n = 0;
+    r->C = C;
+    r->clock = 0;
+    r->cur.pos = start;
+    r->cur.limit = C->end;
+
+    pcapfile_dispatch(&r->cur, -1, split_collect, (u_char*)r);
+
+    C->start = start;
+    C->maxts = r->clock;
+    /* If we stopped short, the rest of the file can't be read. */
+    C->next = r->cur.pos < C->end ? r->F->len : r->cur.pos;
+}
+
+/* split_reader_thread READER
+ * Thread which reads chunks of the file. */
+static void *split_reader_thread(void *v) {
+    struct splitreader *r = (struct splitreader*)v;
+    struct pcapfile *F = r->F;
+    struct pcapsplit *S = F->split;
+
+    pthread_mutex_lock(&S->mtx);
+    while (!S->stop && S->taken < S->nchunks) {
+        size_t num;
+        struct splitchunk *C;
+
+        num = S->taken++;
+        C = S->window + num % S->nwindow;
+        while (!S->stop && num >= S->retired + S->nwindow)
+            pthread_cond_wait(&S->cond, &S->mtx);
+        if (S->stop)
+            break;
+        C->num = num;
+        C->end = S->first + (num + 1) * SPLIT_CHUNK;
+        if (C->end > F->len)
+            C->end = F->len;
+        pthread_mutex_unlock(&S->mtx);
+
+        if (F->format == f_pcapng)
+            split_read(r, C, r->cur.pos);
+        else
+            split_read(r, C, find_record(F, S->first + num * SPLIT_CHUNK, C->end));
+
+        pthread_mutex_lock(&S->mtx);
+        while (!S->stop && S->validated != num)
+            pthread_cond_wait(&S->cond, &S->mtx);
+        if (S->stop)
+            break;
+        if (C->start != S->next) {
+            /* We guessed wrong; read it again from the right place. Nobody
+             * else can change S->next until we're done. */
+            pthread_mutex_unlock(&S->mtx);
+            split_read(r, C, S->next);
+            pthread_mutex_lock(&S->mtx);
+        }
+        C->base = S->clock;
+        if (C->maxts > S->clock)
+            S->clock = C->maxts;
+        S->next = C->next;
+        C->pending = S->nworkers;
+        ++S->validated;
+        pthread_cond_broadcast(&S->cond);
+    }
+    pthread_mutex_unlock(&S->mtx);
+
+    return NULL;
+}
+
+/* pcapfile_split FILE WORKERS OFFSET
+ * Share FILE out among WORKERS workers, the IP header of each packet being at
+ * OFFSET. Returns 0 on success or -1 if the file can't be shared, because it
+ * isn't mapped. */
+int pcapfile_split(struct pcapfile *F, const int nworkers, const int pkt_offset) {
+    struct pcapsplit *S;
+    size_t i;
+
+    if (!F->mapped)
+        return -1;
+
+    alloc_struct(pcapsplit, S);
+    pthread_mutex_init(&S->mtx, NULL);
+    pthread_cond_init(&S->cond, NULL);
+    S->nworkers = nworkers;
+    S->pkt_offset = pkt_offset;
+    S->first = S->next = F->pos;
+    S->nchunks = (F->len - F->pos + SPLIT_CHUNK - 1) / SPLIT_CHUNK;
+
+    S->nreaders = F->format == f_pcapng ? 1 : nworkers;
+    if ((size_t)S->nreaders > S->nchunks)
+        S->nreaders = S->nchunks;
+    S->nwindow = 2 * S->nreaders + 2;
+    S->window = xcalloc(S->nwindow, sizeof *S->window);
+    for (i = 0; i < S->nwindow; ++i)
+        S->window[i].lists = xcalloc(nworkers, sizeof *S->window[i].lists);
+    S->wpos = xcalloc(nworkers, sizeof *S->wpos);
+
+    F->split = S;
+
+    S->readers = xcalloc(S->nreaders, sizeof *S->readers);
+    for (i = 0; i < (size_t)S->nreaders; ++i) {
+        struct splitreader *r = S->readers + i;
+        r->F = F;
+        r->cur = *F;
+        r->cur.cursor = 1;
+        r->cur.split = NULL;
+        /* The reader may come across more interface descriptions. */
+        if (F->nifs) {
+            r->cur.ifs = xmalloc(F->nifs * sizeof *F->ifs);
+            memcpy(r->cur.ifs, F->ifs, F->nifs * sizeof *F->ifs);
+        } else
+            r->cur.ifs = NULL;
+        pthread_create(&r->thread, NULL, split_reader_thread, r);
+    }
+
+    if (verbose)
+        fprintf(stderr, PROGNAME": sharing %lu chunks of dump file among %d workers, with %d readers\n", (unsigned long)S->nchunks, nworkers, S->nreaders);
+
+    return 0;
+}
+
+/* pcapfile_dispatch_share FILE WORKER COUNT CALLBACK USER CLOCK
+ * Like pcapfile_dispatch, but for one of several workers sharing FILE: pass up
+ * to COUNT of the packets meant for WORKER to CALLBACK. Before each packet,
+ * *CLOCK is set to the latest timestamp of all the packets before it in the
+ * file, including those given to other workers. Returns the number of packets
+ * processed, which is 0 once the worker has had all of its packets. */
+int pcapfile_dispatch_share(struct pcapfile *F, const int id, const int cnt, void (*callback)(u_char *, const struct pcap_pkthdr *, const u_char *), u_char *user, time_t *clock) {
+    struct pcapsplit *S = F->split;
+    struct splitpos *P = S->wpos + id;
+    int n = 0;
+
+    while (n < cnt && P->chunk < S->nchunks) {
+        struct splitchunk *C = S->window + P->chunk % S->nwindow;
+        struct splitlist *L;
+
+        if (!P->have) {
+            /* Wait for the reader to finish with it. */
+            pthread_mutex_lock(&S->mtx);
+            pthread_cleanup_push(split_unlock, S);
+            while (P->chunk >= S->validated)
+                pthread_cond_wait(&S->cond, &S->mtx);
+            pthread_cleanup_pop(1);
+            P->have = 1;
+            P->i = 0;
+        }
+
+        L = C->lists + id;
+        if (P->i < L->n) {
+            struct splitpkt *p = L->p + P->i++;
+            *clock = p->clock > C->base ? p->clock : C->base;
+            callback(user, &p->hdr, p->pkt);
+            ++n;
+        } else {
+            /* Finished with this chunk. If everyone else is too, we no longer
+             * need the pages it occupies. */
+            pthread_mutex_lock(&S->mtx);
+            if (--C->pending == 0) {
+                size_t pg = getpagesize(), a, b;
+                a = (C->start + pg - 1) & ~(pg - 1);
+                b = C->next & ~(pg - 1);
+                if (b > a)
+                    madvise(F->data + a, b - a, MADV_DONTNEED);
+                ++S->retired;
+                pthread_cond_broadcast(&S->cond);
+            }
+            pthread_mutex_unlock(&S->mtx);
+            ++P->chunk;
+            P->have = 0;
+        }
+    }
+
+    return n;
+}
+
+/* split_delete SPLIT
+ * Stop the reader threads and free SPLIT. */
+static void split_delete(struct pcapsplit *S) {
+    size_t i;
+
+    pthread_mutex_lock(&S->mtx);
+    S->stop = 1;
+    pthread_cond_broadcast(&S->cond);
+    pthread_mutex_unlock(&S->mtx);
+
+    for (i = 0; i < (size_t)S->nreaders; ++i) {
+        pthread_join(S->readers[i].thread, NULL);
+        xfree(S->readers[i].cur.ifs);
+    }
+    xfree(S->readers);
+
+    for (i = 0; i < S->nwindow; ++i) {
+        int j;
+        for (j = 0; j < S->nworkers; ++j)
+            xfree(S->window[i].lists[j].p);
+        xfree(S->window[i].lists);
+    }
+    xfree(S->window);
+    xfree(S->wpos);
+    pthread_mutex_destroy(&S->mtx);
+    pthread_cond_destroy(&S->cond);
+    xfree(S);
+}
+
+/* pcapfile_close FILE
+ * Close FILE. */
+void pcapfile_close(struct pcapfile *F) {
+    if (F->split)
+        split_delete(F->split);
+    if (F->mapped)
+        munmap(F->data, F->len);
+    else
+        xfree(F->data);
+    if (F->fd > 0)
+        close(F->fd);
+    xfree(F->ifs);
+    xfree(F);
+}
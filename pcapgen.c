@@ -0,0 +1,495 @@
+/*
+ * pcapgen.c:
+ * Generate synthetic pcap dump files for benchmarking driftnet.
+ *
+ * Each flow is an HTTP request and a response carrying a GIF, JPEG, PNG or
+ * MPEG audio object, or some filler HTML. The flows are interleaved, and some
+ * of their segments are delivered out of order or retransmitted. Everything
+ * is derived from a seed with our own random number generator, so that the
+ * same options produce the same file on any platform.
+ *
+ * Copyright (c) 2004 Chris Lightfoot. All rights reserved.
+ * Email: chris@ex-parrot.com; WWW: http://www.ex-parrot.com/~chris/
+ *
+ */
+
+static const char rcsid[] = "$Id$";
+
+#include <sys/types.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef USE_SYS_TYPES_H
+#include <sys/types.h>
+#else
+#include <stdint.h>
+#endif
+
+#define PROGNAME    "pcapgen"
+
+/* Parameters, set from the command line. */
+static int nflows = 1000;       /* number of flows */
+static int concurrency = 64;    /* number of flows in progress at once */
+static int ooo_pct = 5;         /* % of segments swapped with the next */
+static int retx_pct = 1;        /* % of segments sent twice */
+static int filler_pct = 30;     /* % of flows carrying HTML rather than media */
+static int segmin = 536, segmax = 1460;
+static int maxobject = 65536;   /* largest object, in bytes */
+static uint64_t seed = 1;
+
+/* rnd:
+ * Return a pseudo-random 32-bit number (xorshift64*). */
+static uint32_t rnd(void) {
+    seed ^= seed >> 12;
+    seed ^= seed << 25;
+    seed ^= seed >> 27;
+    return (uint32_t)((seed * 0x2545f4914f6cdd1dULL) >> 32);
+}
+
+/* rnd_range LOW HIGH
+ * Return a random number between LOW and HIGH inclusive. */
+static int rnd_range(const int lo, const int hi) {
+    return hi > lo ? lo + (int)(rnd() % (uint32_t)(hi - lo + 1)) : lo;
+}
+
+/* struct buf:
+ * A growable byte buffer. */
+struct buf {
+    unsigned char *p;
+    size_t len, alloc;
+};
+
+static void buf_append(struct buf *b, const void *d, const size_t n) {
+    if (b->len + n > b->alloc) {
+        b->alloc = (b->len + n) * 2;
+        if (!(b->p = realloc(b->p, b->alloc))) {
+            perror(PROGNAME": realloc");
+            exit(1);
+        }
+    }
+    memcpy(b->p + b->len, d, n);
+    b->len += n;
+}
+
+static void buf_byte(struct buf *b, const int c) {
+    unsigned char u = (unsigned char)c;
+    buf_append(b, &u, 1);
+}
+
+static void buf_be16(struct buf *b, const unsigned int v) {
+    buf_byte(b, v >> 8);
+    buf_byte(b, v);
+}
+
+static void buf_be32(struct buf *b, const uint32_t v) {
+    buf_be16(b, v >> 16);
+    buf_be16(b, v & 0xffff);
+}
+
+static void buf_le16(struct buf *b, const unsigned int v) {
+    buf_byte(b, v);
+    buf_byte(b, v >> 8);
+}
+
+/* buf_random BUFFER COUNT AVOID
+ * Append COUNT random bytes to BUFFER, none of which is AVOID (if AVOID is
+ * not -1). */
+static void buf_random(struct buf *b, const size_t n, const int avoid) {
+    size_t i;
+    for (i = 0; i < n; ++i) {
+        int c = rnd() & 0xff;
+        if (c == avoid)
+            c ^= 1;
+        buf_byte(b, c);
+    }
+}
+
+/* crc32 DATA LEN
+ * Compute the CRC used in PNG chunks. */
+static uint32_t crc32(const unsigned char *d, const size_t n) {
+    static uint32_t tbl[256];
+    uint32_t c = 0xffffffff;
+    size_t i;
+    if (!tbl[1]) {
+        for (i = 0; i < 256; ++i) {
+            uint32_t k = (uint32_t)i;
+            int j;
+            for (j = 0; j < 8; ++j)
+                k = (k & 1) ? 0xedb88320 ^ (k >> 1) : k >> 1;
+            tbl[i] = k;
+        }
+    }
+    for (i = 0; i < n; ++i)
+        c = tbl[(c ^ d[i]) & 0xff] ^ (c >> 8);
+    return c ^ 0xffffffff;
+}
+
+/* make_gif, make_jpeg, make_png, make_mpeg, make_html BUFFER SIZE
+ * Append to BUFFER an object of about SIZE bytes of the appropriate type,
+ * well-formed enough for driftnet to recognise it. */
+static void make_gif(struct buf *b, const size_t n) {
+    size_t i;
+    buf_append(b, "GIF89a", 6);
+    buf_le16(b, 1); buf_le16(b, 1);
+    buf_byte(b, 0x80); buf_byte(b, 0); buf_byte(b, 0);
+    buf_append(b, "\0\0\0\xff\xff\xff", 6);                 /* colour table */
+    buf_append(b, "\x21\xf9\x04\0\0\0\0\0", 8);             /* graphic control */
+    buf_byte(b, 0x2c);
+    buf_le16(b, 0); buf_le16(b, 0); buf_le16(b, 1); buf_le16(b, 1);
+    buf_byte(b, 0);
+    buf_byte(b, 2);                                         /* LZW code size */
+    for (i = 0; i < n; i += 255) {
+        size_t k = n - i < 255 ? n - i : 255;
+        buf_byte(b, (int)k);
+        buf_random(b, k, -1);
+    }
+    buf_byte(b, 0);
+    buf_byte(b, 0x3b);
+}
+
+static void make_jpeg(struct buf *b, const size_t n) {
+    int i;
+    buf_append(b, "\xff\xd8\xff\xe0", 4);
+    buf_be16(b, 16);
+    buf_append(b, "JFIF\0\x01\x01\0\0\x01\0\x01\0\0", 14);
+    buf_append(b, "\xff\xdb", 2);
+    buf_be16(b, 67);
+    buf_byte(b, 0);
+    for (i = 1; i <= 64; ++i)
+        buf_byte(b, i);
+    buf_append(b, "\xff\xc0", 2);
+    buf_be16(b, 11);
+    buf_append(b, "\x08\0\x01\0\x01\x01\x01\x11\0", 9);
+    buf_append(b, "\xff\xda", 2);
+    buf_be16(b, 8);
+    buf_append(b, "\x01\x01\0\0\x3f\0", 6);
+    buf_random(b, n, 0xff);                                 /* entropy-coded data */
+    buf_append(b, "\xff\xd9", 2);
+}
+
+static void png_chunk(struct buf *b, const char *type, const unsigned char *d, const size_t n) {
+    size_t start;
+    buf_be32(b, (uint32_t)n);
+    start = b->len;
+    buf_append(b, type, 4);
+    if (n)
+        buf_append(b, d, n);
+    buf_be32(b, crc32(b->p + start, n + 4));
+}
+
+static void make_png(struct buf *b, const size_t n) {
+    static const unsigned char ihdr[13] = {0, 0, 0, 1, 0, 0, 0, 1, 8, 2, 0, 0, 0};
+    struct buf idat = {0};
+    buf_append(b, "\x89PNG\r\n\x1a\n", 8);
+    png_chunk(b, "IHDR", ihdr, sizeof ihdr);
+    buf_random(&idat, n, -1);
+    png_chunk(b, "IDAT", idat.p, idat.len);
+    png_chunk(b, "IEND", NULL, 0);
+    free(idat.p);
+}
+
+static void make_mpeg(struct buf *b, const size_t n) {
+    /* MPEG-1 layer III, 128kbit/s, 44.1kHz, no padding: 417-byte frames. We
+     * need at least 100 of them for driftnet to believe in the stream. */
+    size_t i, nframes = n / 417 < 120 ? 120 : n / 417;
+    for (i = 0; i < nframes; ++i) {
+        buf_append(b, "\xff\xfb\x90\x00", 4);
+        buf_random(b, 417 - 4, -1);
+    }
+}
+
+static void make_html(struct buf *b, const size_t n) {
+    static const char *words[] = {"the", "quick", "brown", "fox", "<b>jumps</b>", "over", "lazy", "<a href=\"/x\">dog</a>", "\n<p>"};
+    buf_append(b, "<html><body>\n", 13);
+    while (b->len < n) {
+        const char *w = words[rnd() % (sizeof words / sizeof *words)];
+        buf_append(b, w, strlen(w));
+        buf_byte(b, ' ');
+    }
+    buf_append(b, "</body></html>\n", 15);
+}
+
+/* struct segment:
+ * A packet to send in a flow: which direction, sequence number, flags and
+ * payload (an extent of the request or response). */
+struct segment {
+    int toserver;
+    uint32_t seq, ack;
+    int flags;
+    size_t off, len;
+};
+
+#define TH_FIN  0x01
+#define TH_SYN  0x02
+#define TH_PUSH 0x08
+#define TH_ACK  0x10
+
+/* struct flow:
+ * A flow being generated. */
+struct flow {
+    uint32_t client, server;
+    uint16_t cport, sport;
+    struct buf req, resp;
+    struct segment *segs;
+    int nsegs, next;
+};
+
+static void add_segment(struct flow *f, const int toserver, const uint32_t seq, const uint32_t ack, const int flags, const size_t off, const size_t len) {
+    struct segment *s;
+    if (!(f->segs = realloc(f->segs, (f->nsegs + 1) * sizeof *f->segs))) {
+        perror(PROGNAME": realloc");
+        exit(1);
+    }
+    s = f->segs + f->nsegs++;
+    s->toserver = toserver;
+    s->seq = seq;
+    s->ack = ack;
+    s->flags = flags;
+    s->off = off;
+    s->len = len;
+}
+
+/* flow_new NUMBER
+ * Make up flow number NUMBER. */
+static void flow_new(struct flow *f, const int num) {
+    uint32_t cisn, sisn, cseq, sseq;
+    size_t size, off, hdrlen;
+    int kind, i, first;
+    char hdr[256];
+    static const char *types[] = {"image/gif", "image/jpeg", "image/png", "audio/mpeg", "text/html"};
+    static const char *exts[] = {"gif", "jpg", "png", "mp3", "html"};
+
+    memset(f, 0, sizeof *f);
+    f->client = 0x0a000000 | (uint32_t)(num & 0xffffff);
+    f->server = 0xc0a80000 | (uint32_t)rnd_range(1, 254);
+    f->cport = (uint16_t)(1024 + num % 60000);
+    f->sport = 80;
+
+    kind = (int)(rnd() % 100) < filler_pct ? 4 : (int)(rnd() % 4);
+    size = (size_t)rnd_range(64, maxobject);
+
+    sprintf(hdr, "GET /object%d.%s HTTP/1.1\r\nHost: www.example.com\r\nUser-Agent: pcapgen\r\n\r\n", num, exts[kind]);
+    buf_append(&f->req, hdr, strlen(hdr));
+
+    /* Leave room for the header, which we fill in once we know the length. */
+    buf_append(&f->resp, hdr, 128);
+    switch (kind) {
+        case 0: make_gif(&f->resp, size); break;
+        case 1: make_jpeg(&f->resp, size); break;
+        case 2: make_png(&f->resp, size); break;
+        case 3: make_mpeg(&f->resp, size); break;
+        default: make_html(&f->resp, size + 128); break;
+    }
+    hdrlen = sprintf(hdr, "HTTP/1.1 200 OK\r\nContent-Type: %s\r\nContent-Length: %lu\r\n\r\n", types[kind], (unsigned long)(f->resp.len - 128));
+    memcpy(f->resp.p + 128 - hdrlen, hdr, hdrlen);
+    memmove(f->resp.p, f->resp.p + 128 - hdrlen, f->resp.len - (128 - hdrlen));
+    f->resp.len -= 128 - hdrlen;
+
+    /* Handshake and request. */
+    cisn = rnd();
+    sisn = rnd();
+    add_segment(f, 1, cisn, 0, TH_SYN, 0, 0);
+    add_segment(f, 0, sisn, cisn + 1, TH_SYN | TH_ACK, 0, 0);
+    cseq = cisn + 1;
+    sseq = sisn + 1;
+    add_segment(f, 1, cseq, sseq, TH_ACK | TH_PUSH, 0, f->req.len);
+    cseq += f->req.len;
+
+    /* Response, in segments of random sizes. */
+    first = f->nsegs;
+    for (off = 0; off < f->resp.len; ) {
+        size_t len = (size_t)rnd_range(segmin, segmax);
+        if (len > f->resp.len - off)
+            len = f->resp.len - off;
+        add_segment(f, 0, sseq + (uint32_t)off, cseq, TH_ACK, off, len);
+        off += len;
+    }
+    sseq += f->resp.len;
+
+    /* Mess it up a bit. */
+    for (i = first; i < f->nsegs - 1; ++i)
+        if ((int)(rnd() % 100) < ooo_pct) {
+            struct segment s = f->segs[i];
+            f->segs[i] = f->segs[i + 1];
+            f->segs[i + 1] = s;
+            ++i;
+        }
+    for (i = first; i < f->nsegs; ++i)
+        if ((int)(rnd() % 100) < retx_pct) {
+            struct segment s = f->segs[i];
+            int at = rnd_range(i + 1, f->nsegs);
+            add_segment(f, 0, 0, 0, 0, 0, 0);
+            memmove(f->segs + at + 1, f->segs + at, (f->nsegs - 1 - at) * sizeof *f->segs);
+            f->segs[at] = s;
+            ++i;
+        }
+
+    add_segment(f, 0, sseq, cseq, TH_FIN | TH_ACK, 0, 0);
+    add_segment(f, 1, cseq, sseq + 1, TH_FIN | TH_ACK, 0, 0);
+}
+
+static void flow_delete(struct flow *f) {
+    free(f->req.p);
+    free(f->resp.p);
+    free(f->segs);
+}
+
+/* write_packet FILE FLOW SEGMENT TIME
+ * Write SEGMENT of FLOW to FILE as an Ethernet frame captured at TIME (in
+ * microseconds). */
+static void write_packet(FILE *fp, const struct flow *f, const struct segment *s, const uint64_t t) {
+    static struct buf b;
+    uint32_t hdr[4];
+    const unsigned char *payload;
+
+    payload = (s->toserver ? f->req.p : f->resp.p) + s->off;
+
+    b.len = 0;
+    buf_append(&b, "\0\x11\x22\x33\x44\x55\0\x66\x77\x88\x99\xaa\x08\x00", 14);
+    /* IP header; checksums are left as zero, since driftnet doesn't care. */
+    buf_byte(&b, 0x45);
+    buf_byte(&b, 0);
+    buf_be16(&b, (unsigned int)(40 + s->len));
+    buf_be16(&b, 0);
+    buf_be16(&b, 0x4000);
+    buf_byte(&b, 64);
+    buf_byte(&b, 6);
+    buf_be16(&b, 0);
+    buf_be32(&b, s->toserver ? f->client : f->server);
+    buf_be32(&b, s->toserver ? f->server : f->client);
+    /* TCP header. */
+    buf_be16(&b, s->toserver ? f->cport : f->sport);
+    buf_be16(&b, s->toserver ? f->sport : f->cport);
+    buf_be32(&b, s->seq);
+    buf_be32(&b, s->ack);
+    buf_byte(&b, 5 << 4);
+    buf_byte(&b, s->flags);
+    buf_be16(&b, 65535);
+    buf_be32(&b, 0);
+    if (s->len)
+        buf_append(&b, payload, s->len);
+
+    hdr[0] = (uint32_t)(t / 1000000);
+    hdr[1] = (uint32_t)(t % 1000000);
+    hdr[2] = hdr[3] = (uint32_t)b.len;
+    fwrite(hdr, sizeof hdr, 1, fp);
+    fwrite(b.p, b.len, 1, fp);
+}
+
+void usage(FILE *fp) {
+    fprintf(fp,
+"pcapgen: generate synthetic dump files for benchmarking driftnet\n"
+"\n"
+"Synopsis: pcapgen [options] [file]\n"
+"\n"
+"Options:\n"
+"\n"
+"  -h               Display this help message.\n"
+"  -n flows         Number of HTTP flows to generate (default %d).\n"
+"  -c flows         Number of flows in progress at once (default %d).\n"
+"  -o percent       Percentage of segments delivered out of order (default %d).\n"
+"  -r percent       Percentage of segments retransmitted (default %d).\n"
+"  -F percent       Percentage of flows carrying HTML filler rather than\n"
+"                   GIF, JPEG, PNG or MPEG objects (default %d).\n"
+"  -s min-max       Range of TCP segment sizes (default %d-%d).\n"
+"  -m size          Largest object size in bytes (default %d).\n"
+"  -S seed          Seed for the random number generator (default 1).\n"
+"\n"
+"The pcap file is written to file, or to standard output if none is given.\n"
+"\n",
+            nflows, concurrency, ooo_pct, retx_pct, filler_pct, segmin, segmax, maxobject);
+}
+
+int main(int argc, char *argv[]) {
+    struct flow *active;
+    int c, nactive = 0, started = 0;
+    uint64_t t = (uint64_t)1000000000 * 1000000;
+    unsigned long npackets = 0;
+    FILE *fp = stdout;
+    struct {
+        uint32_t magic;
+        uint16_t major, minor;
+        int32_t thiszone;
+        uint32_t sigfigs, snaplen, linktype;
+    } filehdr = {0xa1b2c3d4, 2, 4, 0, 0, 262144, 1};
+
+    while ((c = getopt(argc, argv, "hn:c:o:r:F:s:m:S:")) != -1) {
+        switch (c) {
+            case 'h':
+                usage(stdout);
+                return 0;
+            case 'n':
+                nflows = atoi(optarg);
+                break;
+            case 'c':
+                concurrency = atoi(optarg);
+                break;
+            case 'o':
+                ooo_pct = atoi(optarg);
+                break;
+            case 'r':
+                retx_pct = atoi(optarg);
+                break;
+            case 'F':
+                filler_pct = atoi(optarg);
+                break;
+            case 's':
+                if (sscanf(optarg, "%d-%d", &segmin, &segmax) != 2)
+                    segmax = segmin;
+                break;
+            case 'm':
+                maxobject = atoi(optarg);
+                break;
+            case 'S':
+                seed = strtoul(optarg, NULL, 10);
+                break;
+            default:
+                usage(stderr);
+                return 1;
+        }
+    }
+
+    if (nflows < 0 || concurrency < 1 || segmin < 1 || segmax < segmin || maxobject < 64) {
+        usage(stderr);
+        return 1;
+    }
+    /* xorshift must not start from zero. */
+    seed = seed * 0x9e3779b97f4a7c15ULL + 1;
+
+    if (optind < argc && !(fp = fopen(argv[optind], "wb"))) {
+        fprintf(stderr, PROGNAME": %s: %s\n", argv[optind], strerror(errno));
+        return 1;
+    }
+    fwrite(&filehdr, sizeof filehdr, 1, fp);
+
+    active = calloc(concurrency, sizeof *active);
+    while (started < nflows || nactive > 0) {
+        struct flow *f;
+
+        /* Keep the pool of flows full. */
+        while (nactive < concurrency && started < nflows)
+            flow_new(active + nactive++, started++);
+
+        /* Send the next packet of one of them, 20us after the last. */
+        f = active + rnd() % nactive;
+        t += 20;
+        write_packet(fp, f, f->segs + f->next++, t);
+        ++npackets;
+
+        if (f->next == f->nsegs) {
+            flow_delete(f);
+            *f = active[--nactive];
+        }
+    }
+    free(active);
+
+    if (fp != stdout)
+        fclose(fp);
+    fprintf(stderr, PROGNAME": wrote %lu packets in %d flows\n", npackets, nflows);
+
+    return 0;
+}
@@ -47,20 +47,27 @@ static pthread_mutex_t mpeg_mtx = PTHREAD_MUTEX_INITIALIZER;
  * into the decoder. */
 typedef struct _audiochunk {
     unsigned char *data;
-    size_t len;
+    size_t len, alloc;
     struct _audiochunk *next;
 } *audiochunk;
 
 static audiochunk list, wr, rd;
 
+/* Where audiochunks and their data come from. These are shared by the
+ * capture threads and the player thread, so are only used with mpeg_mtx
+ * held. */
+static slab chunkslab;
+static bufpool chunkpool;
+
 /* audiochunk_new:
  * Allocate a buffer and copy some data into it. */
 static audiochunk audiochunk_new(const unsigned char *data, const size_t len) {
     audiochunk A;
-    alloc_struct(_audiochunk, A);
+    A = slab_alloc(chunkslab);
     A->len = len;
     if (data) {
-        A->data = xmalloc(len);
+        A->alloc = len;
+        A->data = bufpool_get(chunkpool, &A->alloc);
         memcpy(A->data, data, len);
     }
     return A;
@@ -69,8 +76,8 @@ static audiochunk audiochunk_new(const unsigned char *data, const size_t len) {
 /* audiochunk_delete:
  * Free memory from an audiochunk. */
 static void audiochunk_delete(audiochunk A) {
-    xfree(A->data);
-    xfree(A);
+    bufpool_put(chunkpool, A->data, A->alloc);
+    slab_free(chunkslab, A);
 }
 
 /* audiochunk_write:
@@ -124,6 +131,18 @@ finish:
     m_unlock;
 }
 
+/* mpeg_alloc_stats OBJECTS BUFFERS
+ * Add the statistics of the allocators for audiochunks and their data to
+ * OBJECTS and BUFFERS. */
+void mpeg_alloc_stats(struct allocstats *objs, struct allocstats *bufs) {
+    m_lock;
+    if (chunkslab) {
+        slab_stats(chunkslab, objs);
+        bufpool_stats(chunkpool, bufs);
+    }
+    m_unlock;
+}
+
 /* mpeg_play:
  * Play MPEG data. This runs in a separate thread. The parameter is the
  * audiochunk from which we start reading data. */
@@ -231,6 +250,8 @@ void do_mpeg_player(void) {
     int pp[2];
     pthread_t thr;
 
+    chunkslab = slab_new(sizeof(struct _audiochunk));
+    chunkpool = bufpool_new();
     rd = wr = list = audiochunk_new(NULL, 0);
 
     pipe(pp);
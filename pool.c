@@ -0,0 +1,291 @@
+/*
+ * pool.c:
+ * Allocate the objects which come and go with connections, recycling them.
+ *
+ * Connections, the buffers which hold their data and the chunks of audio we
+ * pass to the player are allocated and freed at the rate at which flows start
+ * and finish, which on a busy network makes malloc a noticeable cost. A slab
+ * hands out objects of one size, carved from large chunks and kept on a free
+ * list when they are given back; a bufpool hands out buffers whose sizes are
+ * powers of two, keeping those it is given back, up to a limit, for the next
+ * request of the same size. Neither does any locking: each worker has its own,
+ * and anything else must serialise its calls itself.
+ *
+ * Copyright (c) 2004 Chris Lightfoot. All rights reserved.
+ * Email: chris@ex-parrot.com; WWW: http://www.ex-parrot.com/~chris/
+ *
+ */
+
+static const char rcsid[] = "$Id$";
+
+#include <sys/types.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef USE_HUGE_PAGES
+#   include <sys/mman.h>
+#endif
+
+#include "driftnet.h"
+
+/* Size of the chunks from which a slab's objects are carved, and the
+ * alignment of each object. */
+#define SLAB_CHUNK      65536
+#define SLAB_ALIGN      16
+
+/* struct _slab:
+ * The free list is threaded through the objects themselves; the chunks are
+ * linked through their first few bytes. */
+struct _slab {
+    size_t size;
+    void *free, *chunks;
+    unsigned char *next, *end;
+    struct allocstats stats;
+};
+
+/* slab_new SIZE
+ * Return a new, empty slab for objects of SIZE bytes. */
+slab slab_new(const size_t size) {
+    slab S;
+    alloc_struct(_slab, S);
+    S->size = (size < sizeof(void*) ? sizeof(void*) : size);
+    S->size = (S->size + SLAB_ALIGN - 1) & ~(size_t)(SLAB_ALIGN - 1);
+    return S;
+}
+
+/* slab_delete SLAB
+ * Free SLAB and all of the objects in it, whether or not they have been given
+ * back. */
+void slab_delete(slab S) {
+    while (S->chunks) {
+        void *c = S->chunks;
+        S->chunks = *(void**)c;
+        xfree(c);
+    }
+    xfree(S);
+}
+
+/* slab_alloc SLAB
+ * Return a new object from SLAB, zeroed. */
+void *slab_alloc(slab S) {
+    void *v;
+
+    if ((v = S->free)) {
+        S->free = *(void**)v;
+        ++S->stats.nreused;
+    } else {
+        if (S->next + S->size > S->end) {
+            unsigned char *c = xmalloc(SLAB_CHUNK);
+            *(void**)c = S->chunks;
+            S->chunks = c;
+            S->next = c + SLAB_ALIGN;
+            S->end = c + SLAB_CHUNK;
+            S->stats.bytes += SLAB_CHUNK;
+            S->stats.maxbytes = S->stats.bytes;
+        }
+        v = S->next;
+        S->next += S->size;
+    }
+
+    ++S->stats.nalloc;
+    if (++S->stats.nlive > S->stats.maxlive)
+        S->stats.maxlive = S->stats.nlive;
+    memset(v, 0, S->size);
+    return v;
+}
+
+/* slab_free SLAB OBJECT
+ * Give OBJECT back to SLAB, from which it must have come. */
+void slab_free(slab S, void *v) {
+    if (!v)
+        return;
+    *(void**)v = S->free;
+    S->free = v;
+    --S->stats.nlive;
+}
+
+/* slab_stats SLAB STATS
+ * Add SLAB's statistics to STATS. */
+void slab_stats(const slab S, struct allocstats *A) {
+    A->nalloc += S->stats.nalloc;
+    A->nreused += S->stats.nreused;
+    A->nlive += S->stats.nlive;
+    A->maxlive += S->stats.maxlive;
+    A->bytes += S->stats.bytes;
+    A->maxbytes += S->stats.maxbytes;
+}
+
+/* Buffers come in sizes of 2^POOL_MINSHIFT to 2^POOL_MAXSHIFT bytes, with a
+ * list of spare ones for each size. Larger ones are allocated and freed each
+ * time. A pool keeps at most POOL_KEEP bytes of spare buffers. */
+#define POOL_MINSHIFT   6
+#define POOL_MAXSHIFT   23
+#define NCLASSES        (POOL_MAXSHIFT - POOL_MINSHIFT + 1)
+#define POOL_KEEP       (8 * 1024 * 1024)
+
+/* With USE_HUGE_PAGES, buffers of at least this size are mapped separately,
+ * in huge pages if the system has some to spare. */
+#define HUGE_PAGE       (2 * 1024 * 1024)
+
+struct _bufpool {
+    void *free[NCLASSES];
+    size_t kept;
+    struct allocstats stats;
+};
+
+/* bufpool_new:
+ * Return a new pool with no buffers in it. */
+bufpool bufpool_new(void) {
+    bufpool P;
+    alloc_struct(_bufpool, P);
+    return P;
+}
+
+/* size_shift SIZE
+ * Return the log to base 2 of the smallest buffer which holds SIZE bytes. */
+static int size_shift(const size_t size) {
+    int k = POOL_MINSHIFT;
+    while (((size_t)1 << k) < size)
+        ++k;
+    return k;
+}
+
+/* buf_alloc SIZE STATS
+ * Get a new buffer of SIZE bytes from the system, and count it in STATS. */
+static void *buf_alloc(const size_t size, struct allocstats *A) {
+    void *v;
+#ifdef USE_HUGE_PAGES
+    if (size >= HUGE_PAGE) {
+        v = MAP_FAILED;
+#   ifdef MAP_HUGETLB
+        if ((v = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0)) != MAP_FAILED)
+            ++A->nhuge;
+#   endif
+        if (v == MAP_FAILED) {
+            if ((v = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
+                abort();
+#   ifdef MADV_HUGEPAGE
+            madvise(v, size, MADV_HUGEPAGE);
+#   endif
+        }
+    } else
+#endif
+        v = xmalloc(size);
+    A->bytes += size;
+    if (A->bytes > A->maxbytes)
+        A->maxbytes = A->bytes;
+    return v;
+}
+
+/* buf_release BUFFER SIZE STATS
+ * Give BUFFER, of SIZE bytes, back to the system, and count it in STATS. */
+static void buf_release(void *v, const size_t size, struct allocstats *A) {
+#ifdef USE_HUGE_PAGES
+    if (size >= HUGE_PAGE)
+        munmap(v, size);
+    else
+#endif
+        xfree(v);
+    A->bytes -= size;
+}
+
+/* bufpool_delete POOL
+ * Free POOL and the spare buffers in it. Buffers which have not been given
+ * back must be freed with bufpool_put first. */
+void bufpool_delete(bufpool P) {
+    int k;
+    for (k = 0; k < NCLASSES; ++k)
+        while (P->free[k]) {
+            void *v = P->free[k];
+            P->free[k] = *(void**)v;
+            buf_release(v, (size_t)1 << (k + POOL_MINSHIFT), &P->stats);
+        }
+    xfree(P);
+}
+
+/* bufpool_get POOL SIZE
+ * Return a buffer of at least *SIZE bytes from POOL, and set *SIZE to its
+ * actual size. */
+void *bufpool_get(bufpool P, size_t *size) {
+    int k = size_shift(*size);
+    void *v;
+
+    *size = (size_t)1 << k;
+    ++P->stats.nalloc;
+    if (++P->stats.nlive > P->stats.maxlive)
+        P->stats.maxlive = P->stats.nlive;
+    if ((P->stats.inuse += *size) > P->stats.maxinuse)
+        P->stats.maxinuse = P->stats.inuse;
+
+    if (k <= POOL_MAXSHIFT && (v = P->free[k - POOL_MINSHIFT])) {
+        P->free[k - POOL_MINSHIFT] = *(void**)v;
+        P->kept -= *size;
+        ++P->stats.nreused;
+        return v;
+    }
+
+    return buf_alloc(*size, &P->stats);
+}
+
+/* bufpool_put POOL BUFFER SIZE
+ * Give BUFFER back to POOL, from which it must have come. SIZE is the size
+ * which was asked for or the size which was given. */
+void bufpool_put(bufpool P, void *v, size_t size) {
+    int k;
+
+    if (!v)
+        return;
+    --P->stats.nlive;
+
+    k = size_shift(size);
+    size = (size_t)1 << k;
+    P->stats.inuse -= size;
+    if (k <= POOL_MAXSHIFT && P->kept + size <= POOL_KEEP) {
+        *(void**)v = P->free[k - POOL_MINSHIFT];
+        P->free[k - POOL_MINSHIFT] = v;
+        P->kept += size;
+    } else
+        buf_release(v, size, &P->stats);
+}
+
+/* bufpool_resize POOL BUFFER SIZE KEEP WANT
+ * Replace BUFFER, of *SIZE bytes as for bufpool_put, with one of at least
+ * WANT bytes from POOL, copying the first KEEP bytes across, and set *SIZE to
+ * the size of the new buffer, which is returned. BUFFER may be NULL, in which
+ * case a new buffer is returned. */
+void *bufpool_resize(bufpool P, void *v, size_t *size, const size_t keep, const size_t want) {
+    size_t n = want;
+    void *w;
+
+    if (v && size_shift(want) == size_shift(*size))
+        return v;
+    w = bufpool_get(P, &n);
+    if (v) {
+        memcpy(w, v, keep);
+        bufpool_put(P, v, *size);
+    }
+    *size = n;
+    return w;
+}
+
+/* bufpool_stats POOL STATS
+ * Add POOL's statistics to STATS. */
+void bufpool_stats(const bufpool P, struct allocstats *A) {
+    A->nalloc += P->stats.nalloc;
+    A->nreused += P->stats.nreused;
+    A->nlive += P->stats.nlive;
+    A->maxlive += P->stats.maxlive;
+    A->inuse += P->stats.inuse;
+    A->maxinuse += P->stats.maxinuse;
+    A->bytes += P->stats.bytes;
+    A->maxbytes += P->stats.maxbytes;
+    A->nhuge += P->stats.nhuge;
+}
+
+/* bufpool_inuse POOL
+ * Return the number of bytes in buffers which POOL has handed out and which
+ * have not been given back. */
+size_t bufpool_inuse(const bufpool P) {
+    return P->stats.inuse;
+}
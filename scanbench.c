@@ -0,0 +1,523 @@
+/*
+ * scanbench.c:
+ * Microbenchmark for the functions which search connection data for media:
+ * the GIF, JPEG, PNG, MPEG and HTTP scanners, sigscan, memstr and patterns.
+ *
+ * Each scanner is run over several synthetic corpora in two ways: over the
+ * whole buffer at once, and incrementally, calling it again each time another
+ * segment's worth of data is appended to the buffer, which is how
+ * connection_extract_media uses it on a live connection. The media scanners
+ * are also run together, both one after another and sharing a single pass
+ * over the data as connection_extract_media now does. The results are
+ * printed as a table in a fixed format, so that the output of two builds can
+ * be compared with diff.
+ *
+ * Copyright (c) 2004 Chris Lightfoot. All rights reserved.
+ * Email: chris@ex-parrot.com; WWW: http://www.ex-parrot.com/~chris/
+ *
+ */
+
+static const char rcsid[] = "$Id$";
+
+#include <sys/types.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "driftnet.h"
+
+/* image.c */
+unsigned char *find_gif_image(const unsigned char *data, const size_t len, unsigned char **gifdata, size_t *giflen);
+unsigned char *find_jpeg_image(const unsigned char *data, const size_t len, unsigned char **jpegdata, size_t *jpeglen);
+unsigned char *find_png_image(const unsigned char *data, const size_t len, unsigned char **pngdata, size_t *pnglen);
+
+/* audio.c */
+unsigned char *find_mpeg_stream(const unsigned char *data, const size_t len, unsigned char **mpegdata, size_t *mpeglen);
+
+/* http.c */
+unsigned char *find_http_req(const unsigned char *data, const size_t len, unsigned char **http, size_t *httplen);
+
+/* Amount of data a TCP segment adds to the buffer in incremental runs. */
+#define SEGMENT     1448
+
+/* Scanners leave up to this much at the end of the data unexamined, in case
+ * it's the start of something. */
+#define TAIL        16
+
+static uint64_t seed = 1;
+
+/* rnd:
+ * Pseudo-random numbers (xorshift64*), so that the corpora are the same on
+ * every platform. */
+static uint32_t rnd(void) {
+    seed ^= seed >> 12;
+    seed ^= seed << 25;
+    seed ^= seed >> 27;
+    return (uint32_t)((seed * 0x2545f4914f6cdd1dULL) >> 32);
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+ * Corpora. Each function fills LEN bytes at DATA.
+ */
+
+static void put(unsigned char **p, unsigned char *end, const void *d, size_t n) {
+    if (n > (size_t)(end - *p))
+        n = end - *p;
+    memcpy(*p, d, n);
+    *p += n;
+}
+
+static void put_random(unsigned char **p, unsigned char *end, size_t n, const int avoid) {
+    while (n-- > 0 && *p < end) {
+        int c = rnd() & 0xff;
+        *(*p)++ = (unsigned char)(c == avoid ? c ^ 1 : c);
+    }
+}
+
+/* Random bytes. */
+static void corpus_random(unsigned char *data, const size_t len) {
+    unsigned char *p = data;
+    put_random(&p, data + len, len, -1);
+}
+
+/* Web pages: text, markup, and the occasional request. */
+static void corpus_html(unsigned char *data, const size_t len) {
+    static const char *words[] = {
+            "<html>", "<head><title>", "news", "</title></head>", "<body>",
+            "the", "of", "and", "<p>", "<a href=\"http://www.example.com/\">",
+            "</a>", "\r\n", "<img src=\"/logo.gif\" alt=\"\">", "weather",
+            "<div class=\"story\">", "</div>", "GET", "IF", "89", "PNG"
+        };
+    unsigned char *p = data, *end = data + len;
+    while (p < end) {
+        const char *w = words[rnd() % (sizeof words / sizeof *words)];
+        put(&p, end, w, strlen(w));
+        put(&p, end, " ", 1);
+    }
+}
+
+/* TLS application data: record headers followed by ciphertext. */
+static void corpus_tls(unsigned char *data, const size_t len) {
+    unsigned char *p = data, *end = data + len;
+    while (p < end) {
+        unsigned int n = 1 + rnd() % 16384;
+        unsigned char hdr[5];
+        hdr[0] = 0x17; hdr[1] = 3; hdr[2] = 3; hdr[3] = n >> 8; hdr[4] = n & 0xff;
+        put(&p, end, hdr, 5);
+        put_random(&p, end, n, -1);
+    }
+}
+
+static void put_gif(unsigned char **p, unsigned char *end, size_t n) {
+    static const unsigned char hdr[] = "GIF89a\x01\0\x01\0\x80\0\0\0\0\0\xff\xff\xff\x2c\0\0\0\0\x01\0\x01\0\0\x02";
+    put(p, end, hdr, sizeof hdr - 1);
+    while (n > 0 && *p < end) {
+        unsigned char k = n > 255 ? 255 : (unsigned char)n;
+        put(p, end, &k, 1);
+        put_random(p, end, k, -1);
+        n -= k;
+    }
+    put(p, end, "\0\x3b", 2);
+}
+
+static void put_jpeg(unsigned char **p, unsigned char *end, size_t n) {
+    static const unsigned char hdr[] = "\xff\xd8\xff\xe0\0\x10JFIF\0\x01\x01\0\0\x01\0\x01\0\0\xff\xc0\0\x0b\x08\0\x01\0\x01\x01\x01\x11\0\xff\xda\0\x08\x01\x01\0\0\x3f\0";
+    put(p, end, hdr, sizeof hdr - 1);
+    put_random(p, end, n, 0xff);
+    put(p, end, "\xff\xd9", 2);
+}
+
+static void put_png(unsigned char **p, unsigned char *end, size_t n) {
+    static const unsigned char hdr[] = "\x89PNG\r\n\x1a\n\0\0\0\x0dIHDR\0\0\0\x01\0\0\0\x01\x08\x02\0\0\0\0\0\0\0";
+    unsigned char len[8];
+    put(p, end, hdr, sizeof hdr - 1);
+    len[0] = n >> 24; len[1] = n >> 16; len[2] = n >> 8; len[3] = n;
+    memcpy(len + 4, "IDAT", 4);
+    put(p, end, len, 8);
+    put_random(p, end, n + 4, -1);
+    put(p, end, "\0\0\0\0IEND\xae\x42\x60\x82", 12);
+}
+
+static void put_mpeg(unsigned char **p, unsigned char *end, int nframes) {
+    while (nframes-- > 0) {
+        put(p, end, "\xff\xfb\x90\x00", 4);
+        put_random(p, end, 417 - 4, -1);
+    }
+}
+
+static void put_http(unsigned char **p, unsigned char *end) {
+    char req[128];
+    sprintf(req, "GET /images/%08x.gif HTTP/1.1\r\nHost: www.example.com\r\nAccept: */*\r\n\r\n", rnd());
+    put(p, end, req, strlen(req));
+}
+
+/* Nothing but media, back to back. */
+static void corpus_media(unsigned char *data, const size_t len) {
+    unsigned char *p = data, *end = data + len;
+    while (p < end) {
+        switch (rnd() % 5) {
+            case 0: put_gif(&p, end, 1000 + rnd() % 30000); break;
+            case 1: put_jpeg(&p, end, 1000 + rnd() % 30000); break;
+            case 2: put_png(&p, end, 1000 + rnd() % 30000); break;
+            case 3: put_mpeg(&p, end, 100 + rnd() % 50); break;
+            case 4: put_http(&p, end); break;
+        }
+    }
+}
+
+/* Large objects, which arrive over many segments. */
+static void corpus_large(unsigned char *data, const size_t len) {
+    unsigned char *p = data, *end = data + len;
+    while (p < end) {
+        switch (rnd() % 4) {
+            case 0: put_gif(&p, end, 256 * 1024 + rnd() % (768 * 1024)); break;
+            case 1: put_jpeg(&p, end, 256 * 1024 + rnd() % (768 * 1024)); break;
+            case 2: put_png(&p, end, 256 * 1024 + rnd() % (768 * 1024)); break;
+            case 3: put_mpeg(&p, end, 1000 + rnd() % 1000); break;
+        }
+    }
+}
+
+/* Things which look like the start of media, or nearly so, but aren't. */
+static void corpus_nearmiss(unsigned char *data, const size_t len) {
+    static const char *bait[] = {
+            "GIF89", "GIF87a\x01\0\x01\0\x80", "GIF8", "\xff\xd8", "\xff\xd8\xff",
+            "\xff\xd8\xff\xe0\xff\xff", "\x89PNG\r\n\x1a", "\x89PNG\r\n\x1a\n\0\0",
+            "GET ", "GET /x HTTP/1.", "GET / HTTP/1.1\r\n", "\xff\xfb\x90", "\xff\xe0",
+            "\xff\xfb\x90\x00", "\r\n\r", "HTTP/1.1 200"
+        };
+    unsigned char *p = data, *end = data + len;
+    while (p < end) {
+        const char *b = bait[rnd() % (sizeof bait / sizeof *bait)];
+        size_t n = strlen(b);
+        if (n == 0)
+            n = 1;
+        put(&p, end, b, n);
+        put_random(&p, end, rnd() % 24, -1);
+    }
+}
+
+static struct corpus {
+    char *name;
+    void (*fill)(unsigned char *data, const size_t len);
+} corpora[] = {
+        { "random",   corpus_random },
+        { "html",     corpus_html },
+        { "tls",      corpus_tls },
+        { "media",    corpus_media },
+        { "large",    corpus_large },
+        { "nearmiss", corpus_nearmiss }
+    };
+#define NCORPORA    (sizeof corpora / sizeof *corpora)
+
+/*
+ * Scanners. The memstr, scalar and pattern entries search for the needles the
+ * scanners use, with memstr, pattern_find_generic and pattern_find.
+ */
+
+static const unsigned char *needles[3] = {
+        (unsigned char*)"\xff\xd8", (unsigned char*)"GET ", (unsigned char*)"\x89PNG\r\n\x1a\n"
+    };
+static const size_t needlelen[3] = { 2, 4, 8 };
+static pattern patterns[3];
+
+enum searcher { s_memstr, s_scalar, s_pattern };
+
+static unsigned char *search(const enum searcher how, const int k, const unsigned char *data, const size_t len, unsigned char **found, size_t *foundlen) {
+    size_t nlen = needlelen[k];
+    unsigned char *p;
+
+    *found = NULL;
+    if (len < nlen)
+        return (unsigned char*)data;
+
+    switch (how) {
+        case s_memstr:  p = memstr(data, len, needles[k], nlen); break;
+        case s_scalar:  p = pattern_find_generic(patterns[k], data, len); break;
+        default:        p = pattern_find(patterns[k], data, len); break;
+    }
+
+    if (p) {
+        *found = p;
+        *foundlen = nlen;
+        return p + nlen;
+    }
+    return (unsigned char*)(data + len - nlen + 1);
+}
+
+#define SEARCH(name, how, k)    \
+    static unsigned char *name(const unsigned char *data, const size_t len, unsigned char **found, size_t *foundlen) { \
+        return search(how, k, data, len, found, foundlen); \
+    }
+
+SEARCH(find_memstr2,  s_memstr,  0)
+SEARCH(find_memstr4,  s_memstr,  1)
+SEARCH(find_memstr8,  s_memstr,  2)
+SEARCH(find_scalar2,  s_scalar,  0)
+SEARCH(find_scalar4,  s_scalar,  1)
+SEARCH(find_scalar8,  s_scalar,  2)
+SEARCH(find_pattern2, s_pattern, 0)
+SEARCH(find_pattern4, s_pattern, 1)
+SEARCH(find_pattern8, s_pattern, 2)
+
+static struct scanner {
+    char *name;
+    unsigned char *(*find)(const unsigned char *data, const size_t len, unsigned char **found, size_t *foundlen);
+    int onepass;    /* if find is NULL, use scan_media rather than each of find_media in turn */
+} scanners[] = {
+        { "gif",     find_gif_image },
+        { "jpeg",    find_jpeg_image },
+        { "png",     find_png_image },
+        { "mpeg",    find_mpeg_stream },
+        { "http",    find_http_req },
+        { "all",     NULL, 0 },
+        { "onepass", NULL, 1 },
+        { "memstr2", find_memstr2 },
+        { "memstr4", find_memstr4 },
+        { "memstr8", find_memstr8 },
+        { "scalar2", find_scalar2 },
+        { "scalar4", find_scalar4 },
+        { "scalar8", find_scalar8 },
+        { "pattern2", find_pattern2 },
+        { "pattern4", find_pattern4 },
+        { "pattern8", find_pattern8 }
+    };
+#define NSCANNERS   (sizeof scanners / sizeof *scanners)
+
+/* The scanners in the order of the media drivers. */
+static unsigned char *(*find_media[NMEDIATYPES])(const unsigned char *data, const size_t len, unsigned char **found, size_t *foundlen) = {
+        find_gif_image, find_jpeg_image, find_png_image, find_mpeg_stream, find_http_req
+    };
+
+/* scan_one FIND DATA START LEN FOUND
+ * Run FIND over DATA from offset START to LEN as connection_extract_media
+ * used to, adding the number of objects found to *FOUND. Returns the offset
+ * at which the next scan should start. */
+static int scan_one(unsigned char *(*find)(const unsigned char*, const size_t, unsigned char**, size_t*), const unsigned char *data, const int start, const size_t len, unsigned long *nfound) {
+    unsigned char *ptr, *oldptr = NULL, *media;
+    size_t mlen;
+
+    ptr = (unsigned char*)data + start;
+    while (ptr != oldptr && ptr < data + len) {
+        oldptr = ptr;
+        ptr = find(ptr, len - (ptr - data), &media, &mlen);
+        if (media)
+            ++*nfound;
+    }
+    return ptr - data;
+}
+
+static void count_found(const int i, const unsigned char *media, const size_t mlen, void *arg) {
+    ++*(unsigned long*)arg;
+}
+
+/* scan SCANNER DATA MOFF MSTATE LEN FOUND
+ * Run SCANNER over the first LEN bytes of DATA, starting from and updating
+ * the offsets in MOFF, one for each media type (or just one if SCANNER is a
+ * single function), and parser states MSTATE, adding the number of objects
+ * found to *FOUND. */
+static void scan(const struct scanner *S, const unsigned char *data, int *moff, struct mediastate *mstate, const size_t len, unsigned long *nfound) {
+    int i;
+    if (S->find)
+        moff[0] = scan_one(S->find, data, moff[0], len, nfound);
+    else if (S->onepass)
+        scan_media(data, len, moff, mstate, (1 << NMEDIATYPES) - 1, count_found, nfound);
+    else
+        for (i = 0; i < NMEDIATYPES; ++i)
+            moff[i] = scan_one(find_media[i], data, moff[i], len, nfound);
+}
+
+/* run_whole, run_incremental SCANNER DATA LEN FOUND STALLS
+ * Scan DATA all at once, or as if it arrived a segment at a time. A scanner
+ * stops making progress when it finds something which might be the start of
+ * an object but which runs past the end of the data; on a connection it would
+ * wait there for more. Over the whole corpus there isn't any more, so we
+ * count a stall and carry on from the next byte, so that the rest of the
+ * corpus is measured too. When the data arrive a segment at a time, a stall
+ * is a segment after which the scanner is still where it was before. */
+static void run_whole(const struct scanner *S, const unsigned char *data, const size_t len, unsigned long *nfound, unsigned long *nstalls) {
+    int moff[NMEDIATYPES] = {0}, i, n = S->find ? 1 : NMEDIATYPES, stalled;
+    struct mediastate mstate[NMEDIATYPES] = {{0}};
+    do {
+        scan(S, data, moff, mstate, len, nfound);
+        stalled = 0;
+        for (i = 0; i < n; ++i)
+            if (moff[i] + TAIL < len) {
+                ++*nstalls;
+                ++moff[i];
+                stalled = 1;
+            }
+    } while (stalled);
+}
+
+static void run_incremental(const struct scanner *S, const unsigned char *data, const size_t len, unsigned long *nfound, unsigned long *nstalls) {
+    int moff[NMEDIATYPES] = {0}, old[NMEDIATYPES], i, n = S->find ? 1 : NMEDIATYPES;
+    struct mediastate mstate[NMEDIATYPES] = {{0}};
+    size_t have;
+    for (have = SEGMENT; have < len + SEGMENT; have += SEGMENT) {
+        memcpy(old, moff, sizeof moff);
+        scan(S, data, moff, mstate, have < len ? have : len, nfound);
+        for (i = 0; i < n; ++i)
+            if (moff[i] == old[i])
+                ++*nstalls;
+    }
+}
+
+/* measure SCANNER DATA LEN RUN MINTIME REPEATS FOUND STALLS
+ * Return the best rate, in bytes per second, over REPEATS trials, each of
+ * which runs RUN enough times to take at least MINTIME seconds. */
+static double measure(const struct scanner *S, const unsigned char *data, const size_t len, void (*run)(const struct scanner*, const unsigned char*, const size_t, unsigned long*, unsigned long*), const double mintime, const int repeats, unsigned long *nfound, unsigned long *nstalls) {
+    double best = 0;
+    int r;
+
+    for (r = 0; r < repeats; ++r) {
+        double t0, t;
+        unsigned long iters = 0;
+        t0 = now();
+        do {
+            *nfound = *nstalls = 0;
+            run(S, data, len, nfound, nstalls);
+            ++iters;
+        } while ((t = now() - t0) < mintime);
+        if (iters * (double)len / t > best)
+            best = iters * (double)len / t;
+    }
+    return best;
+}
+
+void usage(FILE *fp) {
+    fprintf(fp,
+"scanbench: benchmark driftnet's media scanners\n"
+"\n"
+"Synopsis: scanbench [options] [scanner | corpus ...]\n"
+"\n"
+"Options:\n"
+"\n"
+"  -h               Display this help message.\n"
+"  -s size          Size of each corpus in Kbytes (default 4096).\n"
+"  -i size          Size of corpora for incremental runs, in Kbytes\n"
+"                   (default 1024).\n"
+"  -t seconds       Minimum time for each trial (default 0.2).\n"
+"  -r number        Number of trials, of which the best is reported\n"
+"                   (default 3).\n"
+"  -S seed          Seed for generating the corpora (default 1).\n"
+"\n"
+"If any scanners or corpora are named, only those are run. Scanners are\n"
+"gif, jpeg, png, mpeg, http, all (each of those in turn), onepass (all of\n"
+"them using a single pass to find their signatures), memstr2, memstr4 and\n"
+"memstr8 (memstr with needles of those lengths), scalar2 etc. (the same\n"
+"with compiled patterns but no vector instructions) and pattern2 etc. (with\n"
+"whatever the processor supports); corpora are random, html, tls, media,\n"
+"large and nearmiss.\n"
+"\n");
+}
+
+/* selected NAME ARGC ARGV
+ * Should we run the scanner or corpus NAME, given the names on the command
+ * line? */
+static int selected(const char *name, const int kind, int argc, char *argv[]) {
+    int i, any = 0;
+    for (i = optind; i < argc; ++i) {
+        size_t k;
+        int iskind = 0;
+        if (kind == 0) {
+            for (k = 0; k < NSCANNERS; ++k)
+                if (!strcmp(argv[i], scanners[k].name))
+                    iskind = 1;
+        } else {
+            for (k = 0; k < NCORPORA; ++k)
+                if (!strcmp(argv[i], corpora[k].name))
+                    iskind = 1;
+        }
+        if (iskind) {
+            any = 1;
+            if (!strcmp(argv[i], name))
+                return 1;
+        }
+    }
+    return !any;
+}
+
+int main(int argc, char *argv[]) {
+    size_t size = 4096 * 1024, isize = 1024 * 1024, i, j;
+    double mintime = 0.2;
+    int repeats = 3, c;
+    unsigned char *data[NCORPORA];
+
+    while ((c = getopt(argc, argv, "hs:i:t:r:S:")) != -1) {
+        switch (c) {
+            case 'h':
+                usage(stdout);
+                return 0;
+            case 's':
+                size = (size_t)atoi(optarg) * 1024;
+                break;
+            case 'i':
+                isize = (size_t)atoi(optarg) * 1024;
+                break;
+            case 't':
+                mintime = atof(optarg);
+                break;
+            case 'r':
+                repeats = atoi(optarg);
+                break;
+            case 'S':
+                seed = strtoul(optarg, NULL, 10);
+                break;
+            default:
+                usage(stderr);
+                return 1;
+        }
+    }
+    if (size < SEGMENT || isize < SEGMENT || repeats < 1 || mintime <= 0) {
+        usage(stderr);
+        return 1;
+    }
+    if (isize > size)
+        isize = size;
+    seed = seed * 0x9e3779b97f4a7c15ULL + 1;
+
+    for (i = 0; i < 3; ++i)
+        patterns[i] = pattern_new(needles[i], needlelen[i]);
+
+    for (j = 0; j < NCORPORA; ++j) {
+        data[j] = xmalloc(size);
+        corpora[j].fill(data[j], size);
+    }
+
+    printf("%-9s %-9s %-11s %8s %9s %8s %8s\n", "scanner", "corpus", "mode", "Kbytes", "MB/s", "found", "stalls");
+    for (i = 0; i < NSCANNERS; ++i) {
+        if (!selected(scanners[i].name, 0, argc, argv))
+            continue;
+        for (j = 0; j < NCORPORA; ++j) {
+            unsigned long nfound, nstalls;
+            double rate;
+
+            if (!selected(corpora[j].name, 1, argc, argv))
+                continue;
+
+            rate = measure(scanners + i, data[j], size, run_whole, mintime, repeats, &nfound, &nstalls);
+            printf("%-9s %-9s %-11s %8lu %9.1f %8lu %8lu\n", scanners[i].name, corpora[j].name, "whole", (unsigned long)(size / 1024), rate / 1e6, nfound, nstalls);
+
+            rate = measure(scanners + i, data[j], isize, run_incremental, mintime, repeats, &nfound, &nstalls);
+            printf("%-9s %-9s %-11s %8lu %9.1f %8lu %8lu\n", scanners[i].name, corpora[j].name, "incremental", (unsigned long)(isize / 1024), rate / 1e6, nfound, nstalls);
+            fflush(stdout);
+        }
+    }
+
+    for (j = 0; j < NCORPORA; ++j)
+        xfree(data[j]);
+    for (i = 0; i < 3; ++i)
+        pattern_delete(patterns[i]);
+
+    return 0;
+}
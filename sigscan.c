@@ -0,0 +1,315 @@
+/*
+ * sigscan.c:
+ * Find the signatures of all the media types in a buffer in one pass.
+ *
+ * Rather than have each media driver search the whole of a buffer for its own
+ * signatures, we read the buffer once, making a list of the places where any
+ * of them appear, and then have each driver's parser look at the places which
+ * concern it. Almost every position can be dismissed on the value of the byte
+ * there and the one after it, since each signature starts with one of a few
+ * pairs of bytes, and memchr_pair can look for those a block at a time.
+ *
+ * Copyright (c) 2004 Chris Lightfoot. All rights reserved.
+ * Email: chris@ex-parrot.com; WWW: http://www.ex-parrot.com/~chris/
+ *
+ */
+
+static const char rcsid[] = "$Id$";
+
+#include <sys/types.h>
+
+#include <string.h>
+
+#include "driftnet.h"
+
+/* image.c */
+unsigned char *check_gif_image(const unsigned char *data, const size_t len, struct mediastate *S, unsigned char **gifdata, size_t *giflen);
+unsigned char *check_jpeg_image(const unsigned char *data, const size_t len, struct mediastate *S, unsigned char **jpegdata, size_t *jpeglen);
+unsigned char *check_png_image(const unsigned char *data, const size_t len, struct mediastate *S, unsigned char **pngdata, size_t *pnglen);
+
+/* audio.c */
+unsigned char *check_mpeg_stream(const unsigned char *data, const size_t len, struct mediastate *S, unsigned char **mpegdata, size_t *mpeglen);
+
+/* http.c */
+unsigned char *check_http_req(const unsigned char *data, const size_t len, struct mediastate *S, unsigned char **http, size_t *httplen);
+
+/* The parser for each signature, in the order of the SIG_ bits. */
+static unsigned char *(*check_data[NMEDIATYPES])(const unsigned char *data, const size_t len, struct mediastate *S, unsigned char **found, size_t *foundlen) = {
+        check_gif_image,
+        check_jpeg_image,
+        check_png_image,
+        check_mpeg_stream,
+        check_http_req
+    };
+
+/* The signatures which may start with each byte value. */
+static const unsigned char first_byte[256] = {
+        ['G']  = SIG_GIF | SIG_HTTP,
+        [0x89] = SIG_PNG,
+        [0xff] = SIG_JPEG | SIG_MPEG
+    };
+
+/* match DATA AVAIL SIG LEN
+ * Does DATA, of which AVAIL bytes are available, start with SIG of length
+ * LEN? Returns 1 if it does, 0 if not, or -1 if we can't tell yet. */
+static int match(const unsigned char *data, const size_t avail, const char *sig, const size_t len) {
+    if (avail < len)
+        return memcmp(data, sig, avail) ? 0 : -1;
+    else
+        return memcmp(data, sig, len) ? 0 : 1;
+}
+
+/* check_sigs DATA AVAIL SIGS
+ * Which of SIGS does DATA, with AVAIL bytes available, start with? Returns a
+ * mask of SIG_ bits, or -1 if we need more data to tell. */
+static int check_sigs(const unsigned char *data, const size_t avail, const int sigs) {
+    int found = 0, m;
+
+    if (sigs & SIG_GIF) {
+        if ((m = match(data, avail, "GIF8", 4)) == 1 && avail < 6)
+            m = -1;
+        if (m == -1)
+            return -1;
+        else if (m == 1 && (data[4] == '7' || data[4] == '9') && data[5] == 'a')
+            found |= SIG_GIF;
+    }
+
+    if (sigs & SIG_HTTP) {
+        if ((m = match(data, avail, "GET ", 4)) == -1)
+            return -1;
+        else if (m == 1)
+            found |= SIG_HTTP;
+    }
+
+    if (sigs & SIG_PNG) {
+        if ((m = match(data, avail, "\x89PNG\r\n\x1a\n", 8)) == -1)
+            return -1;
+        else if (m == 1)
+            found |= SIG_PNG;
+    }
+
+    if (sigs & (SIG_JPEG | SIG_MPEG)) {
+        /* JPEG SOI marker, or MPEG frame sync. */
+        if (avail < 2)
+            return -1;
+        else if ((sigs & SIG_JPEG) && data[1] == 0xd8)
+            found |= SIG_JPEG;
+        else if ((sigs & SIG_MPEG) && (data[1] & 0xe0) == 0xe0) {
+            /* The MPEG parser needs a whole frame header. */
+            if (avail < 5)
+                return -1;
+            found |= SIG_MPEG;
+        }
+    }
+
+    return found;
+}
+
+/* match_sigs DATA AVAIL SIGS
+ * Which of SIGS does DATA, with AVAIL bytes available, start with? Returns as
+ * check_sigs does. */
+int match_sigs(const unsigned char *data, const size_t avail, const int sigs) {
+    if (avail == 0)
+        return -1;
+    return check_sigs(data, avail, first_byte[*data] & sigs);
+}
+
+/* check_media I DATA LEN
+ * Does DATA, of length LEN, start with a whole object which parser I
+ * recognises? Returns the length of the object, or 0 if not. */
+size_t check_media(const int i, const unsigned char *data, const size_t len) {
+    struct mediastate S;
+    unsigned char *media;
+    size_t mlen;
+
+    memset(&S, 0, sizeof S);
+    check_data[i](data, len, &S, &media, &mlen);
+    return media == data ? mlen : 0;
+}
+
+/* classify_stream DATA LEN
+ * Say what a stream carries from DATA, the first LEN bytes of it. Streams
+ * which start with a TLS record or an SSH banner are encrypted from then on,
+ * and can't contain anything we can find; anything we don't recognise might
+ * still do so. An HTTP client which starts with a GET or HEAD is probably
+ * only sending requests, whereas one which starts with a POST or PUT may be
+ * sending media of its own. */
+enum streamtype classify_stream(const unsigned char *data, const size_t len) {
+    if (len >= 5 && data[0] >= 0x14 && data[0] <= 0x17 && data[1] == 3 && data[2] <= 4
+        && ((data[3] << 8) | data[4]) <= 18432)
+        /* Record type (change_cipher_spec, alert, handshake or data),
+         * version 3.x, and a length no more than the protocol allows. */
+        return st_tls;
+    else if (len >= 5 && memcmp(data, "SSH-", 4) == 0 && data[4] >= '1' && data[4] <= '2')
+        return st_ssh;
+    else if (len >= 5 && memcmp(data, "HTTP/", 5) == 0)
+        return st_response;
+    else if (len >= 4 && (memcmp(data, "GET ", 4) == 0 || memcmp(data, "HEAD", 4) == 0))
+        return st_request;
+    else if (len >= 4 && (memcmp(data, "POST", 4) == 0 || memcmp(data, "PUT ", 4) == 0))
+        return st_upload;
+    else if (len > 0 && check_sigs(data, len, first_byte[*data] & ~SIG_HTTP) > 0)
+        return st_media;
+    else
+        return st_unknown;
+}
+
+/* sigscan DATA LEN AVAIL SIGS CAND NCAND SCANNED
+ * Look for the signatures SIGS starting in the first LEN of the AVAIL bytes
+ * at DATA, recording up to NCAND of the places where they occur, in order, in
+ * CAND. Returns the number of candidates found; *SCANNED is set to the offset
+ * from which to continue the search, which is short of LEN if CAND filled up
+ * or if there might be a signature at the very end of the data which we can't
+ * see all of yet. */
+size_t sigscan(const unsigned char *data, const size_t len, const size_t avail, const int sigs, struct sigcand *cand, const size_t ncand, size_t *scanned) {
+    const unsigned char *p = data, *end = data + len;
+    struct bytepair pairs[MAX_PAIRS];
+    size_t n = 0;
+    int npairs = 0;
+
+    /* The first two bytes of the signatures we want. */
+    if (sigs & SIG_GIF)
+        pairs[npairs++] = (struct bytepair){ 'G', 'I', 0xff };
+    if (sigs & SIG_HTTP)
+        pairs[npairs++] = (struct bytepair){ 'G', 'E', 0xff };
+    if (sigs & SIG_PNG)
+        pairs[npairs++] = (struct bytepair){ 0x89, 'P', 0xff };
+    if (sigs & SIG_JPEG)
+        pairs[npairs++] = (struct bytepair){ 0xff, 0xd8, 0xff };
+    if (sigs & SIG_MPEG)
+        pairs[npairs++] = (struct bytepair){ 0xff, 0xe0, 0xe0 };
+
+    while (p < end && n < ncand) {
+        size_t look;
+        int s;
+
+        /* Skip places which can't start any signature we want, looking one
+         * byte beyond the end, if we have it, to see the second byte of a
+         * signature starting at the last place. */
+        look = end - p + 1;
+        if (look > avail - (p - data))
+            look = avail - (p - data);
+        if (!(p = memchr_pair(p, look, pairs, npairs)) || p >= end) {
+            p = end;
+            break;
+        }
+
+        if ((s = check_sigs(p, avail - (p - data), first_byte[*p] & sigs)) == -1)
+            break;
+        else if (s) {
+            cand[n].off = p - data;
+            cand[n].sigs = s;
+            ++n;
+        }
+        ++p;
+    }
+
+    *scanned = p - data;
+    return n;
+}
+
+/* check_candidate I DATA LEN OFF PTR MSTATE ACTIVE FOUND ARG
+ * Have parser I look at the candidate at OFF in DATA, of length LEN, calling
+ * FOUND with ARG if it finds an object. PTR[I] is updated to where the parser
+ * should carry on, and if it needs more data, it is removed from *ACTIVE, and
+ * MSTATE[I] records how far it got with the candidate. */
+static void check_candidate(const int i, const unsigned char *data, const size_t len, const size_t off, size_t *ptr, struct mediastate *mstate, int *active, void (*found)(const int i, const unsigned char *media, const size_t mlen, void *arg), void *arg) {
+    struct mediastate *S = mstate + i;
+    unsigned char *p, *media;
+    size_t mlen;
+
+    /* Any state we have is only good for the candidate it came from, and
+     * only if the data it describes are still there. */
+    if (S->start != off || S->pos > len - off) {
+        memset(S, 0, sizeof *S);
+        S->start = off;
+    }
+
+    p = check_data[i](data + off, len - off, S, &media, &mlen);
+    if (media)
+        found(i, media, mlen, arg);
+    if (p == data + off) {
+        *active &= ~(1 << i);
+        ptr[i] = off;
+    } else {
+        memset(S, 0, sizeof *S);
+        ptr[i] = p - data;
+    }
+}
+
+/* Number of candidates we deal with at once. We start with only a few,
+ * since a parser which gets stuck waiting for more data makes any candidates
+ * beyond it wasted effort. */
+#define NCANDS      256
+#define NCANDS0     4
+
+/* scan_media DATA LEN MOFF MSTATE SIGS FOUND ARG
+ * Search DATA, of length LEN, for media of the types in SIGS. MOFF gives, for
+ * each type, the offset from which to search, and is updated to where the
+ * next search should start; MSTATE holds each type's parser state, which
+ * lets it carry on from where it got to with an object which it has seen
+ * only part of. For each object found, FOUND is called with the
+ * type's index, the object and its length, and ARG. */
+void scan_media(const unsigned char *data, const size_t len, int *moff, struct mediastate *mstate, const int sigs, void (*found)(const int i, const unsigned char *media, const size_t mlen, void *arg), void *arg) {
+    struct sigcand cand[NCANDS];
+    size_t pos, ptr[NMEDIATYPES], ncand = NCANDS0;
+    int i, active = 0;
+
+    /* A parser which was waiting for more data at a candidate last time
+     * usually still is, so try those first. */
+    for (i = 0; i < NMEDIATYPES; ++i)
+        if (sigs & (1 << i)) {
+            ptr[i] = moff[i];
+            active |= 1 << i;
+            if (ptr[i] < len && (first_byte[data[ptr[i]]] & (1 << i))
+                && check_sigs(data + ptr[i], len - ptr[i], 1 << i) == (1 << i))
+                check_candidate(i, data, len, ptr[i], ptr, mstate, &active, found, arg);
+        }
+
+    /* Parsers become inactive when they are waiting for more data at a
+     * candidate. Each stretch of the data is scanned only for the signatures
+     * of those parsers which have got as far as it. */
+    while (active) {
+        size_t next = len, n, k, scanned;
+        int want = 0;
+
+        pos = len;
+        for (i = 0; i < NMEDIATYPES; ++i)
+            if ((active & (1 << i)) && ptr[i] < pos)
+                pos = ptr[i];
+        if (pos >= len)
+            break;
+        for (i = 0; i < NMEDIATYPES; ++i)
+            if (active & (1 << i)) {
+                if (ptr[i] == pos)
+                    want |= 1 << i;
+                else if (ptr[i] < next)
+                    next = ptr[i];
+            }
+
+        n = sigscan(data + pos, next - pos, len - pos, want, cand, ncand, &scanned);
+        if (ncand < NCANDS)
+            ncand *= 2;
+
+        for (k = 0; k < n; ++k) {
+            size_t off = pos + cand[k].off;
+            for (i = 0; i < NMEDIATYPES; ++i)
+                if ((cand[k].sigs & active & (1 << i)) && off >= ptr[i])
+                    check_candidate(i, data, len, off, ptr, mstate, &active, found, arg);
+        }
+
+        /* Parsers which were looking at this stretch and aren't waiting at a
+         * candidate in it carry on from the end of it. */
+        for (i = 0; i < NMEDIATYPES; ++i)
+            if ((want & active & (1 << i)) && ptr[i] < pos + scanned)
+                ptr[i] = pos + scanned;
+
+        /* A signature at the end of the data which we can't see all of. */
+        if (n == 0 && scanned < next - pos)
+            break;
+    }
+
+    for (i = 0; i < NMEDIATYPES; ++i)
+        if (sigs & (1 << i))
+            moff[i] = ptr[i];
+}